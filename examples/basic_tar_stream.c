@@ -10,15 +10,32 @@
  */
 
 #include "minotar.h"
+#include <sys/stat.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <stdlib.h>
+
+// the largest chunk minotar_recommended_chunk_size() asks for
+#define MAX_CHUNK_SIZE (4 * 1024 * 1024)
+
+#if MINOTAR_HAVE_PROGRESS
+static void show_progress(void* context, const minotar_progress_t* progress)
+{
+    (void) context;
+
+    printf("%llu of %llu bytes, %zu entries, %.*s\n", (unsigned long long) progress->bytes_consumed,
+           (unsigned long long) progress->total_bytes, progress->entries_completed,
+           (int) progress->entry_length, progress->entry != NULL ? progress->entry : "");
+}
+#endif
 
 int main(int argc, char* argv[])
 {
-    minotar_t* minotar;
+    minotar_t* minotar = NULL;
     FILE* some_archive = NULL;
     char* file_name = NULL;
-    char file_buf[256] = {0};
+    char* file_buf = NULL;
+    struct stat st = {0};
     size_t read_size = 0;
     char target_dir[] = "./";
     minotar_error_t err;
@@ -29,7 +46,7 @@ int main(int argc, char* argv[])
     }
     file_name = argv[1];
     
-    if(access(file_name, F_OK) < 0) {
+    if(stat(file_name, &st) < 0) {
         printf("file <%s> does not exist. Cannot parse.\n", file_name);
         goto exit;
     }
@@ -48,6 +65,18 @@ int main(int argc, char* argv[])
         goto exit;
     }
     
+    // with the archive size known progress includes the total
+    minotar_set_input_length(minotar, (uint64_t) st.st_size);
+#if MINOTAR_HAVE_PROGRESS
+    minotar_set_progress_callback(minotar, show_progress, NULL, 500);
+#endif
+    
+    file_buf = malloc(MAX_CHUNK_SIZE);
+    if(file_buf == NULL) {
+        printf("out of memory.\n");
+        goto exit;
+    }
+    
     // open up the file for reading
     some_archive = fopen(file_name, "rb");
     if(some_archive == NULL) {
@@ -55,8 +84,8 @@ int main(int argc, char* argv[])
         goto exit;
     }
     
-    // read the file in in 256 byte chunks and decode it.
-    while((read_size = fread(file_buf, 1, sizeof(file_buf), some_archive)) > 0) {
+    // read the file in chunks sized to how fast minotar is going and decode it.
+    while((read_size = fread(file_buf, 1, minotar_recommended_chunk_size(minotar), some_archive)) > 0) {
         err = minotar_decode(minotar, file_buf, read_size);
         if(err != MINOTAR_noerror) {
             printf("decode failed (%d).  exiting.\n", err);
@@ -64,10 +93,19 @@ int main(int argc, char* argv[])
         }
     }
     
+    if(!minotar_is_end_of_archive(minotar)) {
+        printf("archive <%s> is truncated.\n", file_name);
+        goto exit;
+    }
+    
     printf("successfully decoded %s.  exiting.\n", file_name);
     
 exit:
     // tear down the library
-    minotar_deinit(&minotar);
+    if(minotar != NULL)
+        minotar_deinit(&minotar);
+    if(some_archive != NULL)
+        fclose(some_archive);
+    free(file_buf);
     return 0;
 }
@@ -0,0 +1,63 @@
+/**
+ * Copyright (c) 2017 Michael Skeffington
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ * See the file COPYING included with this distribution for more
+ * information.
+ */
+
+#include "minotar_batch.h"
+#include <stdio.h>
+
+static void job_done(void* context, const char* input_path, minotar_error_t result)
+{
+    (void) context;
+
+    if(result != MINOTAR_noerror)
+        printf("decode of <%s> failed (%d).\n", input_path, result);
+}
+
+int main(int argc, char* argv[])
+{
+    minotar_batch_t* batch = NULL;
+    minotar_batch_config_t config = {0};
+    minotar_error_t err;
+
+    if(argc < 3) {
+        printf("Usage: minotar_batch <directory> <filename>.tar [<filename>.tar ...]\n");
+        goto exit;
+    }
+
+    // at most 16 MiB of read buffers and 64 open files, whatever the thread count
+    config.memory_budget = 16 * 1024 * 1024;
+    config.max_open_files = 64;
+    config.chunk_size = 256 * 1024;
+
+    err = minotar_batch_init(&batch, &config);
+    if(err != MINOTAR_noerror) {
+        printf("Minotar batch failed to initialize. (%d)\n", err);
+        goto exit;
+    }
+
+    // queue every archive, they are extracted as workers free up
+    for(int idx = 2; idx < argc; ++idx) {
+        err = minotar_batch_submit(batch, argv[idx], argv[1], job_done, NULL);
+        if(err != MINOTAR_noerror) {
+            printf("failed to queue <%s> (%d).\n", argv[idx], err);
+            goto exit;
+        }
+    }
+
+    if(minotar_batch_wait(batch) == MINOTAR_noerror)
+        printf("successfully decoded %d archives.  exiting.\n", argc - 2);
+
+exit:
+    // tear down the batch service
+    if(batch != NULL)
+        minotar_batch_deinit(&batch);
+
+    return 0;
+}
@@ -0,0 +1,192 @@
+/**
+ * Copyright (c) 2017 Michael Skeffington
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ * See the file COPYING included with this distribution for more
+ * information.
+ */
+
+// clock_gettime() is POSIX, not C11
+#define _XOPEN_SOURCE 700
+
+#include "minotar.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef __ELF__
+#include <elf.h>
+#endif
+
+#if defined(MINOTAR_PROFILE_TINY)
+#define PROFILE_NAME "tiny"
+#elif defined(MINOTAR_PROFILE_FAST)
+#define PROFILE_NAME "fast"
+#else
+#define PROFILE_NAME "default"
+#endif
+
+// the build passes the library this was linked against, for the code size
+#ifndef MINOTAR_LIBRARY_FILE
+#define MINOTAR_LIBRARY_FILE "libminotar.so"
+#endif
+
+#define VALIDATE_ROUNDS 10
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Add up the loaded sections of the library the way size(1) does: read-only sections
+ * count as text, writable ones as data and bss.
+ *
+ * @return false when the library is not a 64-bit ELF file.
+ */
+static bool code_size(const char* library, size_t* text, size_t* data, size_t* bss)
+{
+    bool result = false;
+#ifdef __ELF__
+    FILE* file = fopen(library, "rb");
+    Elf64_Ehdr header;
+    Elf64_Shdr section;
+
+    *text = *data = *bss = 0;
+
+    if(file == NULL || fread(&header, sizeof(header), 1, file) != 1 ||
+       memcmp(header.e_ident, ELFMAG, SELFMAG) != 0 || header.e_ident[EI_CLASS] != ELFCLASS64)
+        goto exit;
+
+    for(size_t idx = 0; idx < header.e_shnum; ++idx) {
+        if(fseek(file, (long) (header.e_shoff + idx * header.e_shentsize), SEEK_SET) != 0 ||
+           fread(&section, sizeof(section), 1, file) != 1)
+            goto exit;
+
+        if(!(section.sh_flags & SHF_ALLOC))
+            continue;
+        if(section.sh_type == SHT_NOBITS)
+            *bss += section.sh_size;
+        else if(section.sh_flags & SHF_WRITE)
+            *data += section.sh_size;
+        else
+            *text += section.sh_size;
+    }
+    result = true;
+
+exit:
+    if(file != NULL)
+        fclose(file);
+#else
+    (void) library;
+    (void) text;
+    (void) data;
+    (void) bss;
+#endif
+    return result;
+}
+
+/**
+ * Decode an archive held in memory in chunk_size pieces.
+ *
+ * @return the error of the first failed decode, or of a missing end of archive.
+ */
+static minotar_error_t run(const char* archive, size_t length, size_t chunk_size, const char* directory,
+                           bool validate_only)
+{
+    minotar_t* minotar = NULL;
+    minotar_error_t err;
+
+    err = minotar_init(&minotar);
+    if(err != MINOTAR_noerror)
+        return err;
+
+    err = minotar_set_extract_directory(minotar, directory);
+    if(err == MINOTAR_noerror)
+        err = minotar_set_validate_only(minotar, validate_only);
+
+    for(size_t offset = 0; err == MINOTAR_noerror && offset < length; offset += chunk_size) {
+        size_t read_size = length - offset < chunk_size ? length - offset : chunk_size;
+        err = minotar_decode(minotar, &archive[offset], read_size);
+    }
+
+    if(err == MINOTAR_noerror && !minotar_is_end_of_archive(minotar))
+        err = MINOTAR_truncated_archive;
+
+    minotar_deinit(&minotar);
+    return err;
+}
+
+int main(int argc, char* argv[])
+{
+    FILE* some_archive = NULL;
+    char* archive = NULL;
+    long length = 0;
+    size_t chunk_size = 256;
+    double start = 0;
+    size_t text = 0;
+    size_t data = 0;
+    size_t bss = 0;
+    minotar_error_t err;
+
+    if(argc < 3) {
+        printf("Usage: minotar_benchmark <filename>.tar <directory> [chunk size]\n");
+        goto exit;
+    }
+
+    if(argc > 3)
+        chunk_size = strtoul(argv[3], NULL, 10);
+    if(chunk_size == 0)
+        chunk_size = 256;
+
+    // the whole archive is read up front so only decoding is measured
+    some_archive = fopen(argv[1], "rb");
+    if(some_archive == NULL || fseek(some_archive, 0, SEEK_END) != 0 || (length = ftell(some_archive)) <= 0) {
+        printf("archive <%s> failed to open.\n", argv[1]);
+        goto exit;
+    }
+    rewind(some_archive);
+
+    archive = malloc(length);
+    if(archive == NULL || fread(archive, 1, length, some_archive) != (size_t) length) {
+        printf("archive <%s> failed to read.\n", argv[1]);
+        goto exit;
+    }
+
+    printf("profile %s, %ld byte archive, %zu byte chunks\n", PROFILE_NAME, length, chunk_size);
+
+    if(code_size(MINOTAR_LIBRARY_FILE, &text, &data, &bss))
+        printf("code size: %zu text, %zu data, %zu bss bytes\n", text, data, bss);
+    else
+        printf("code size: unknown, %s is not a 64-bit ELF file\n", MINOTAR_LIBRARY_FILE);
+
+    start = now();
+    for(int round = 0; round < VALIDATE_ROUNDS; ++round) {
+        err = run(archive, length, chunk_size, argv[2], true);
+        if(err != MINOTAR_noerror) {
+            printf("validate failed (%d).  exiting.\n", err);
+            goto exit;
+        }
+    }
+    printf("validate: %8.1f MB/s\n", VALIDATE_ROUNDS * length / (now() - start) / 1e6);
+
+    start = now();
+    err = run(archive, length, chunk_size, argv[2], false);
+    if(err != MINOTAR_noerror) {
+        printf("extract failed (%d).  exiting.\n", err);
+        goto exit;
+    }
+    printf("extract:  %8.1f MB/s\n", length / (now() - start) / 1e6);
+
+exit:
+    free(archive);
+    if(some_archive != NULL)
+        fclose(some_archive);
+
+    return 0;
+}
@@ -0,0 +1,90 @@
+/**
+ * Copyright (c) 2017 Michael Skeffington
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ * See the file COPYING included with this distribution for more
+ * information.
+ */
+
+#include "minotar.h"
+#include "minotar_gzindex.h"
+#include <stdio.h>
+
+int main(int argc, char* argv[])
+{
+    FILE* some_archive = NULL;
+    FILE* index_file = NULL;
+    minotar_gzindex_t* index = NULL;
+    minotar_t* minotar = NULL;
+    char target_dir[] = "./";
+    minotar_error_t err;
+
+    if(argc < 3) {
+        printf("Usage: minotar_gzindex <filename>.tar.gz <index file> [member]\n");
+        goto exit;
+    }
+
+    some_archive = fopen(argv[1], "rb");
+    if(some_archive == NULL) {
+        printf("archive <%s> failed to open.\n", argv[1]);
+        goto exit;
+    }
+
+    // reuse a saved index, otherwise inflate the archive once and save one
+    index_file = fopen(argv[2], "rb");
+    if(index_file != NULL) {
+        err = minotar_gzindex_load(&index, index_file);
+    }
+    else {
+        err = minotar_gzindex_build(&index, some_archive, 0);
+        if(err == MINOTAR_noerror && (index_file = fopen(argv[2], "wb")) != NULL)
+            err = minotar_gzindex_save(index, index_file);
+    }
+
+    if(err != MINOTAR_noerror) {
+        printf("index failed (%d).  exiting.\n", err);
+        goto exit;
+    }
+
+    // without a member name just list what is in the archive
+    if(argc < 4) {
+        for(size_t idx = 0; idx < minotar_gzindex_get_member_count(index); ++idx)
+            printf("%s\n", minotar_gzindex_get_member_name(index, idx));
+        goto exit;
+    }
+
+    err = minotar_init(&minotar);
+    if(err != MINOTAR_noerror) {
+        printf("Minotar failed to initialize. (%d)\n", err);
+        goto exit;
+    }
+
+    err = minotar_set_extract_directory(minotar, target_dir);
+    if(err != MINOTAR_noerror) {
+        printf("Minotar failed to set set directory. (%d)\n", err);
+        goto exit;
+    }
+
+    err = minotar_gzindex_extract(index, some_archive, argv[3], minotar);
+    if(err != MINOTAR_noerror) {
+        printf("extract of <%s> failed (%d).  exiting.\n", argv[3], err);
+        goto exit;
+    }
+
+    printf("successfully extracted %s.  exiting.\n", argv[3]);
+
+exit:
+    if(minotar != NULL)
+        minotar_deinit(&minotar);
+    if(index != NULL)
+        minotar_gzindex_deinit(&index);
+    if(index_file != NULL)
+        fclose(index_file);
+    if(some_archive != NULL)
+        fclose(some_archive);
+
+    return 0;
+}
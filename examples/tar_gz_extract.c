@@ -13,12 +13,17 @@
 #include "zlib.h"
 #include <unistd.h>
 #include <stdio.h>
+#include <stdlib.h>
+
+// the largest chunk minotar_recommended_chunk_size() asks for
+#define MAX_CHUNK_SIZE (4 * 1024 * 1024)
 
 static void print_gzip_error(int retcode)
 {
     switch (retcode) {
         case Z_NEED_DICT:
             printf("Zlib dictionary Error.\n");
+            break;
         case Z_DATA_ERROR:
             printf("Zlib invalid data error.\n");
             break;
@@ -38,10 +43,10 @@ int main(int argc, char* argv[])
 {
     FILE* some_archive = NULL;
     z_stream z_context;
-    minotar_t* minotar_context;
+    minotar_t* minotar_context = NULL;
     char* file_name = NULL;
-    char file_buf[256] = {0};
-    unsigned char ex_file_buf[256] = {0};
+    char file_buf[64 * 1024] = {0};
+    unsigned char* ex_file_buf = NULL;
     size_t read_size = 0;
     char target_dir[] = "./";
     int z_ret = Z_OK;
@@ -82,6 +87,12 @@ int main(int argc, char* argv[])
         goto exit;
     }
     
+    ex_file_buf = malloc(MAX_CHUNK_SIZE);
+    if(ex_file_buf == NULL) {
+        printf("out of memory.\n");
+        goto exit;
+    }
+    
     // open up the file for reading
     some_archive = fopen(file_name, "rb");
     if(some_archive == NULL) {
@@ -90,7 +101,7 @@ int main(int argc, char* argv[])
     }
     
     
-    // read the file in in 256 byte chunks and decode it.
+    // read the file in in 64 KiB chunks and decode it.
     while((read_size = fread(file_buf, 1, sizeof(file_buf), some_archive)) > 0) {
         z_context.avail_in = read_size;
         if (z_context.avail_in == 0) {
@@ -100,9 +111,10 @@ int main(int argc, char* argv[])
         // zlib requires unsigned... annoying
         z_context.next_in = (unsigned char*)file_buf;
 
-        // our output buffer is small so just loop till we copy out all of it
+        // hand minotar as much as it can use at once, looping till we copy out all of it
         do {
-            z_context.avail_out = sizeof(ex_file_buf);
+            size_t chunk_size = minotar_recommended_chunk_size(minotar_context);
+            z_context.avail_out = chunk_size;
             z_context.next_out = ex_file_buf;
             
             if((z_ret = inflate(&z_context, Z_NO_FLUSH)) < 0 && z_ret != Z_BUF_ERROR) {
@@ -110,7 +122,7 @@ int main(int argc, char* argv[])
                 goto exit;
             }
 
-            size_t decode_size = sizeof(ex_file_buf) - z_context.avail_out;
+            size_t decode_size = chunk_size - z_context.avail_out;
 
             // pass the decoded bytes to minotar
             if(minotar_decode(minotar_context, (char*) ex_file_buf, decode_size) != MINOTAR_noerror) {
@@ -127,6 +139,11 @@ int main(int argc, char* argv[])
         }
     }
     
+    if(!minotar_is_end_of_archive(minotar_context)) {
+        printf("archive <%s> is truncated.\n", file_name);
+        goto exit;
+    }
+    
     printf("successfully decoded %s.  exiting.\n", file_name);
     
 exit:
@@ -137,5 +154,9 @@ exit:
     // clean up zlib.
     inflateEnd(&z_context);
     
+    if(some_archive != NULL)
+        fclose(some_archive);
+    free(ex_file_buf);
+    
     return 0;
 }
@@ -16,12 +16,15 @@
 #include <stdbool.h>
 #include <inttypes.h>
 #include <stddef.h>
+#include <sys/types.h>
+#if !defined(MINOTAR_PROFILE_TINY)
 #include <stdio.h>
+#endif
 
 /**
  * Minotar is a MINimal memory Overhead TARball extraction library.  It accomplishes
- * this by only holding 560 bytes at a time in memory and parsing the incoming data as a
- * stream.  Each file is parsed and written to disk in-band.  A system which has little
+ * this by only holding one 512 byte header block and the parser state in memory and
+ * parsing the incoming data as a stream.  Each file is parsed and written to disk in-band.  A system which has little
  * memory can effectively receive a file from an external source without needing enough
  * room to store both the packaged tarball on disk or in memory at the same time as the 
  * divided file data.  This mechanism is very useful for things such as firmware updates
@@ -29,9 +32,60 @@
  * 
  * It is very simple to wrap Minotar and give gzip functionality.  See the examples 
  * directory for usage.
+ *
+ * GNU sparse files ('S' typeflag and the PAX 0.0, 0.1 and 1.0 sparse formats) are
+ * expanded by writing each data segment at its offset and leaving the gaps as holes
+ * in the extracted file.
  */
 
 
+/**
+ * Build profiles.  CMake defines MINOTAR_PROFILE_TINY or MINOTAR_PROFILE_FAST for the
+ * library and everything linking it, the default profile defines neither.  Each
+ * feature can also be set on its own.
+ *
+ * tiny:    no heap (one static instance), no stdio, no progress reports and ustar
+ *          only.  PAX headers are skipped and GNU sparse files rejected.
+ * fast:    SIMD header checksums and file data coalesced into large writes.
+ */
+#if defined(MINOTAR_PROFILE_TINY)
+#ifndef MINOTAR_HAVE_HEAP
+#define MINOTAR_HAVE_HEAP           0
+#endif
+#ifndef MINOTAR_HAVE_EXTENSIONS
+#define MINOTAR_HAVE_EXTENSIONS     0   // PAX headers, GNU sparse files and hole detection
+#endif
+#ifndef MINOTAR_HAVE_PROGRESS
+#define MINOTAR_HAVE_PROGRESS       0   // progress reports and throughput-based chunk sizes
+#endif
+#endif
+
+#if defined(MINOTAR_PROFILE_FAST)
+#ifndef MINOTAR_HAVE_SIMD
+#define MINOTAR_HAVE_SIMD           1
+#endif
+#ifndef MINOTAR_WRITE_BUFFER_SIZE
+#define MINOTAR_WRITE_BUFFER_SIZE   (256 * 1024)
+#endif
+#endif
+
+#ifndef MINOTAR_HAVE_HEAP
+#define MINOTAR_HAVE_HEAP           1
+#endif
+#ifndef MINOTAR_HAVE_EXTENSIONS
+#define MINOTAR_HAVE_EXTENSIONS     1
+#endif
+#ifndef MINOTAR_HAVE_PROGRESS
+#define MINOTAR_HAVE_PROGRESS       1
+#endif
+#ifndef MINOTAR_HAVE_SIMD
+#define MINOTAR_HAVE_SIMD           0
+#endif
+#ifndef MINOTAR_WRITE_BUFFER_SIZE
+#define MINOTAR_WRITE_BUFFER_SIZE   0   // 0 writes file data as it arrives
+#endif
+
+
 /**
  * Minotar error codes.
  */
@@ -44,6 +98,12 @@ typedef enum minotar_error_ {
     MINOTAR_failed_to_create_file,
     MINOTAR_header_invalid,
     MINOTAR_out_of_memory,
+    MINOTAR_failed_to_write,
+    MINOTAR_would_block,
+    MINOTAR_truncated_archive,
+    MINOTAR_decompress_failed,
+    MINOTAR_member_not_found,
+    MINOTAR_invalid_padding,
     MINOTAR_unknown_error
 } minotar_error_t;
 
@@ -52,8 +112,92 @@ typedef enum minotar_error_ {
 typedef struct minotar_ minotar_t;
 
 /**
- * Initialize the Minotar library.  This function allocates 560 bytes of data for
- * the interal structure.
+ * A sink receives the payload of each extracted file.  The default sink writes
+ * straight to the file with pwrite().  A custom sink can hand the data to a writer
+ * thread or an async I/O queue and push back when that queue is full.  Such a sink
+ * must also provide finish, since without it Minotar closes the file as soon as the
+ * last write() returns.
+ */
+typedef struct minotar_sink_ {
+    /**
+     * Write up to length bytes of the current file at offset.
+     * 
+     * @param context   The context pointer of this sink.
+     * @param fd        The file descriptor of the file being extracted.
+     * @return the number of bytes taken, or -1 with errno set.  Returning 0 or -1 with
+     *         errno EAGAIN tells Minotar to stop and report MINOTAR_would_block.
+     */
+    ssize_t (*write)(void* context, int fd, uint64_t offset, const char* bytes, size_t length);
+    
+    /**
+     * Optional.  @return a file descriptor that polls writable once the sink can take
+     * more data, or -1.
+     */
+    int (*poll_fd)(void* context);
+    
+    void* context;
+    
+    /**
+     * Optional.  Called once all data of the current file was taken.  The sink owns
+     * the file descriptor from here on: it completes any queued writes, sets the file
+     * length to size (sparse files may end in a hole) and closes fd.  Without it the
+     * file is truncated and closed right away.
+     * 
+     * @param context   The context pointer of this sink.
+     * @param fd        The file descriptor of the file being extracted.
+     * @param size      The length the file must end up with.
+     * @return 0 once fd is closed, or -1 with errno set.  errno EAGAIN keeps the entry
+     *         open, reports MINOTAR_would_block and calls finish again on the next decode.
+     */
+    int (*finish)(void* context, int fd, uint64_t size);
+} minotar_sink_t;
+
+/**
+ * Called when the end of archive marker is decoded.
+ * 
+ * @param context   The context pointer given with the callback.
+ * @param archive   The number of archives completed so far, starting at 1.
+ */
+typedef void (*minotar_archive_callback_t)(void* context, size_t archive);
+
+/**
+ * Called with the data of every file as it is decoded, for example to hash it.  Only
+ * the data stored in the archive is passed, the holes of a sparse file are not.
+ * 
+ * @param context   The context pointer given with the callback.
+ * @param bytes     The next run of file data, or NULL once the entry is complete.
+ * @param length    The length of the run, 0 once the entry is complete.
+ */
+typedef void (*minotar_payload_callback_t)(void* context, const char* bytes, size_t length);
+
+#if MINOTAR_HAVE_PROGRESS
+/**
+ * Where a decode stands.
+ */
+typedef struct minotar_progress_ {
+    uint64_t    bytes_consumed;     // bytes of the stream decoded so far
+    uint64_t    total_bytes;        // length of the stream if set with minotar_set_input_length(), or 0
+    uint64_t    throughput;         // recent decode rate in bytes per second, 0 until measured.
+                                    // only time spent inside the decode calls counts.
+    size_t      entries_completed;
+    const char* entry;              // name of the entry being written, or NULL between entries.
+    size_t      entry_length;       // The name is not null-terminated.
+} minotar_progress_t;
+
+/**
+ * Called with the progress of a decode, at most once per interval.
+ * 
+ * @param context   The context pointer given with the callback.
+ * @param progress  Only valid for the duration of the call.
+ */
+typedef void (*minotar_progress_callback_t)(void* context, const minotar_progress_t* progress);
+#endif
+
+/**
+ * Initialize the Minotar library.  This function allocates the interal structure,
+ * whose size depends on the build profile, and in the fast profile the write buffer.
+ * Without a heap there is a single static instance and a second init fails with
+ * MINOTAR_out_of_memory until it is deinitialized.
  * 
  * @return an error code as defined in the error struct.
  */
@@ -78,16 +222,92 @@ minotar_error_t minotar_reset(minotar_t* instance);
 
 /**
  * Instruct Minotar to extract this archive to a path other than ./
- * This path may be fully qualified or it can be relative.
+ * This path may be fully qualified or it can be relative.  Nothing is ever created
+ * outside of it: entry paths lose any leading '/' and "." components, entries with
+ * ".." components fail with MINOTAR_invalid_path, and symlinks the archive creates
+ * are never followed out of the directory.
  * 
  * @param path  A null-terminated pointer to a path on the filesystem.
  * @return an error code as defined in the error struct.
  */
 minotar_error_t minotar_set_extract_directory(minotar_t* instance, const char* path);
 
+/**
+ * Turn runs of zeros in ordinary files into holes instead of writing them out.
+ * This saves disk space and write time for disk images and database files that
+ * were archived without sparse support.  Disabled by default.
+ * 
+ * @param enable    true to detect zero runs, false to write every byte.
+ * @return an error code as defined in the error struct.
+ */
+#if MINOTAR_HAVE_EXTENSIONS
+minotar_error_t minotar_set_sparse_detection(minotar_t* instance, bool enable);
+#endif
+
+
+/**
+ * Keep decoding after the end of archive marker (two zero blocks) and treat the next
+ * block that is not padding as the start of another archive.  This lets one stream
+ * carry a sequence of archives without re-initializing between them.  When disabled,
+ * the default, everything after the end of archive marker is ignored.
+ * 
+ * @param enable    true to extract every archive in the stream, false to stop after the first.
+ * @return an error code as defined in the error struct.
+ */
+minotar_error_t minotar_set_concatenated(minotar_t* instance, bool enable);
+
+/**
+ * Register a function called each time the end of an archive is reached.  The
+ * callback may change the extract directory for the archive that follows.
+ * 
+ * @param callback  The function to call, or NULL.
+ * @param context   Passed back to the callback.
+ * @return an error code as defined in the error struct.
+ */
+minotar_error_t minotar_set_archive_callback(minotar_t* instance, minotar_archive_callback_t callback, void* context);
+
+/**
+ * @return true once the end of archive marker has been decoded and no other archive
+ *         has started since.  An archive that ends without it was truncated.
+ */
+bool minotar_is_end_of_archive(minotar_t* instance);
+
+/**
+ * Check the archive instead of extracting it.  Every header has its checksum, numeric
+ * fields and paths checked, padding must be zero and, when the input length is known,
+ * no record may run past the end of the input.  Nothing is written to the filesystem
+ * and file data is skipped without being looked at unless a payload callback is set,
+ * so validation runs at memory speed.  Check minotar_is_end_of_archive() at the end.
+ * 
+ * @param enable    true to only validate, false to extract.
+ * @return an error code as defined in the error struct.
+ */
+minotar_error_t minotar_set_validate_only(minotar_t* instance, bool enable);
+
+/**
+ * Tell Minotar how long the input stream is, when it is known.  A header claiming
+ * more data than the stream has left then fails with MINOTAR_truncated_archive before
+ * anything is written for it.
+ * 
+ * @param length    The length of the whole stream in bytes, or 0 if unknown.
+ * @return an error code as defined in the error struct.
+ */
+minotar_error_t minotar_set_input_length(minotar_t* instance, uint64_t length);
+
+/**
+ * Register a function that sees the data of every file, for example to hash it while
+ * validating.
+ * 
+ * @param callback  The function to call, or NULL.
+ * @param context   Passed back to the callback.
+ * @return an error code as defined in the error struct.
+ */
+minotar_error_t minotar_set_payload_callback(minotar_t* instance, minotar_payload_callback_t callback, void* context);
 
 /**
  * Decode the next block of data.  This function automatically writes the file to disk.
+ * Headers that lie whole in the buffer are read from it without being copied, so
+ * larger buffers decode faster.
  * 
  * @param bytes     A buffer of bytes as it comes in from the file.
  * @param length    the length of buffer bytes.
@@ -95,5 +315,69 @@ minotar_error_t minotar_set_extract_directory(minotar_t* instance, const char* p
  */
 minotar_error_t minotar_decode(minotar_t* instance, const char* bytes, size_t length);
 
+/**
+ * Hand payload writes to a custom sink instead of writing the files directly.
+ * 
+ * @param sink  The sink to use, or NULL to go back to writing files directly.
+ * @return an error code as defined in the error struct.
+ */
+minotar_error_t minotar_set_sink(minotar_t* instance, const minotar_sink_t* sink);
+
+/**
+ * Decode as much of the next block of data as the sink will take.  Unlike
+ * minotar_decode() this never waits on the sink, so many streams can share one
+ * event-loop thread.  When the sink pushes back, MINOTAR_would_block is returned and
+ * the caller should wait for minotar_get_poll_fd() to become writable and then call
+ * again with the bytes that were not consumed, even when that is none because the
+ * sink is still finishing the last file.  Minotar holds none of them itself.
+ * 
+ * @param bytes     A buffer of bytes as it comes in from the file.
+ * @param length    the length of buffer bytes.
+ * @param consumed  Set to the number of bytes accepted.
+ * @return an error code as defined in the error struct.
+ */
+minotar_error_t minotar_decode_nonblocking(minotar_t* instance, const char* bytes, size_t length, size_t* consumed);
+
+/**
+ * @return the file descriptor to wait on before resuming a blocked decode, or -1 when
+ *         the sink does not provide one.
+ */
+int minotar_get_poll_fd(minotar_t* instance);
+
+#if MINOTAR_HAVE_PROGRESS
+/**
+ * Register a function that reports progress.  The clock is only read every 64 KiB of
+ * input, so the callback costs nothing per decode call.  It is also called once at the
+ * end of each archive.
+ * 
+ * @param callback      The function to call, or NULL.
+ * @param context       Passed back to the callback.
+ * @param interval_ms   The least time between two calls.
+ * @return an error code as defined in the error struct.
+ */
+minotar_error_t minotar_set_progress_callback(minotar_t* instance, minotar_progress_callback_t callback,
+                                              void* context, uint32_t interval_ms);
+
+/**
+ * Get the progress of the decode, for callers that poll.
+ * 
+ * @param progress  Filled in with the current progress.
+ * @return an error code as defined in the error struct.
+ */
+minotar_error_t minotar_get_progress(minotar_t* instance, minotar_progress_t* progress);
+#endif
+
+/**
+ * Suggest how many bytes to pass to the next decode.  The size is derived from the
+ * time spent inside the decode calls, sink included, so each call covers about a
+ * millisecond of work: slow sinks get small reads and fast ones large reads.  Time
+ * spent producing the data, such as reading or inflating it, is not counted.  It is
+ * always a multiple of 512 between 4 KiB and 4 MiB, and 64 KiB until a rate has been
+ * measured.  Without MINOTAR_HAVE_PROGRESS nothing is measured and it is always 64 KiB.
+ * 
+ * @return the recommended chunk size in bytes.
+ */
+size_t minotar_recommended_chunk_size(minotar_t* instance);
+
 #endif // MINOTAR_TARBALL_EXTRACT_H
 
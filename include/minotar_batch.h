@@ -0,0 +1,82 @@
+/**
+ * Copyright (c) 2017 Michael Skeffington
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ * See the file COPYING included with this distribution for more
+ * information.
+ */
+
+
+#ifndef MINOTAR_BATCH_H
+#define MINOTAR_BATCH_H
+
+#include "minotar.h"
+
+/**
+ * The batch service extracts many archives concurrently.  Jobs are queued per worker
+ * thread and idle workers steal from the others, so a few large archives do not hold
+ * up the rest.  Input buffers come from a shared pool bounded by a memory budget and
+ * running jobs are limited so the open file descriptors stay under a cap.
+ */
+
+
+// batch extraction service
+typedef struct minotar_batch_ minotar_batch_t;
+
+/**
+ * Batch configuration.  Any field left 0 takes its default.
+ */
+typedef struct minotar_batch_config_ {
+    size_t threads;         // worker threads, defaults to the number of online CPUs
+    size_t memory_budget;   // bytes of input and write buffers across all jobs, defaults to 64 MiB
+    size_t max_open_files;  // file descriptors across all jobs, defaults to 256
+    size_t chunk_size;      // bytes read from an archive at a time, defaults to 1 MiB
+} minotar_batch_config_t;
+
+/**
+ * Called from a worker thread when a job is done.
+ *
+ * @param context       The context pointer given with the job.
+ * @param input_path    The archive that was extracted.
+ * @param result        MINOTAR_noerror or the error that stopped the extraction.
+ */
+typedef void (*minotar_batch_callback_t)(void* context, const char* input_path, minotar_error_t result);
+
+/**
+ * Start a batch service and its worker threads.
+ *
+ * @param config    The configuration, or NULL for the defaults.
+ * @return an error code as defined in the error struct.
+ */
+minotar_error_t minotar_batch_init(minotar_batch_t** p_batch, const minotar_batch_config_t* config);
+
+/**
+ * Wait for all jobs, stop the worker threads and free the batch service.
+ *
+ * @return an error code as defined in the error struct.
+ */
+minotar_error_t minotar_batch_deinit(minotar_batch_t** p_batch);
+
+/**
+ * Queue an archive for extraction.  Both paths are copied.
+ *
+ * @param input_path    Path of the tar archive.
+ * @param extract_path  Directory to extract into, or NULL for ./
+ * @param callback      Optional function called when the job is done.
+ * @param context       Passed back to the callback.
+ * @return an error code as defined in the error struct.
+ */
+minotar_error_t minotar_batch_submit(minotar_batch_t* batch, const char* input_path, const char* extract_path,
+                                     minotar_batch_callback_t callback, void* context);
+
+/**
+ * Wait until every queued job is done.
+ *
+ * @return the first error any job ran into since the last wait, or MINOTAR_noerror.
+ */
+minotar_error_t minotar_batch_wait(minotar_batch_t* batch);
+
+#endif // MINOTAR_BATCH_H
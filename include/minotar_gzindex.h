@@ -0,0 +1,91 @@
+/**
+ * Copyright (c) 2017 Michael Skeffington
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ * See the file COPYING included with this distribution for more
+ * information.
+ */
+
+
+#ifndef MINOTAR_GZINDEX_H
+#define MINOTAR_GZINDEX_H
+
+#include "minotar.h"
+#include <stdio.h>
+
+/**
+ * A gzip index gives random access into a .tar.gz archive.  While the archive is
+ * inflated once, the deflate state (the last 32 KiB of output and the bit position in
+ * the input) is saved every span bytes of uncompressed output, and the offset of every
+ * tar member is recorded.  Extracting a single member then only inflates from the
+ * nearest checkpoint in front of it instead of from the start of the archive.
+ *
+ * The index can be saved next to the archive and loaded again later.  It covers the
+ * first gzip member of the file, which is all that gzip and tar write.
+ */
+
+
+// checkpoint index of a .tar.gz archive
+typedef struct minotar_gzindex_ minotar_gzindex_t;
+
+/**
+ * Inflate a .tar.gz archive once and build its index.
+ *
+ * @param archive   The archive, opened for reading.
+ * @param span      Uncompressed bytes between checkpoints, 0 for 1 MiB.  Every
+ *                  checkpoint costs 32 KiB of memory and index file.
+ * @return an error code as defined in the error struct.
+ */
+minotar_error_t minotar_gzindex_build(minotar_gzindex_t** p_index, FILE* archive, uint64_t span);
+
+/**
+ * Free an index.
+ *
+ * @return an error code as defined in the error struct.
+ */
+minotar_error_t minotar_gzindex_deinit(minotar_gzindex_t** p_index);
+
+/**
+ * Write an index to a file.
+ *
+ * @param out   A file opened for writing.
+ * @return an error code as defined in the error struct.
+ */
+minotar_error_t minotar_gzindex_save(const minotar_gzindex_t* index, FILE* out);
+
+/**
+ * Read an index written by minotar_gzindex_save().
+ *
+ * @param in    A file opened for reading.
+ * @return an error code as defined in the error struct.
+ */
+minotar_error_t minotar_gzindex_load(minotar_gzindex_t** p_index, FILE* in);
+
+/**
+ * @return the number of tar members in the index.
+ */
+size_t minotar_gzindex_get_member_count(const minotar_gzindex_t* index);
+
+/**
+ * @return the name of a tar member, from its PAX header when it has one, or NULL.
+ */
+const char* minotar_gzindex_get_member_name(const minotar_gzindex_t* index, size_t member);
+
+/**
+ * Extract one member of the archive.  Only the data from the nearest checkpoint in
+ * front of the member is inflated.  The member goes through the given instance, so it
+ * lands in that instance's extract directory.
+ *
+ * @param archive   The archive the index was built from, opened for reading.
+ * @param name      The member name as returned by minotar_gzindex_get_member_name().
+ * @param instance  A Minotar instance.  It is reset first, so one instance can extract
+ *                  any number of members.
+ * @return an error code as defined in the error struct.
+ */
+minotar_error_t minotar_gzindex_extract(const minotar_gzindex_t* index, FILE* archive, const char* name,
+                                        minotar_t* instance);
+
+#endif // MINOTAR_GZINDEX_H
@@ -0,0 +1,563 @@
+/**
+ * Copyright (c) 2017 Michael Skeffington
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ * See the file COPYING included with this distribution for more
+ * information.
+ */
+
+// pthreads, strdup() and sysconf() are POSIX, not C11
+#define _XOPEN_SOURCE 700
+
+#include "minotar_batch.h"
+#include <pthread.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// every running job holds the archive, the extract directory and the cached parent
+// directory open.  on top of that comes the file being extracted, or the two that
+// are open at once while a path is walked a component at a time.
+#define MINOTAR_BATCH_FILES_PER_JOB  (5)
+
+#define MINOTAR_BATCH_DEFAULT_BUDGET      (64 * 1024 * 1024)
+#define MINOTAR_BATCH_DEFAULT_OPEN_FILES  (256)
+#define MINOTAR_BATCH_DEFAULT_CHUNK_SIZE  (1024 * 1024)
+
+
+// ---------------- INTERNAL STRUCTURES -----------------------
+
+struct minotar_batch_job_ {
+    char*                       input_path;
+    char*                       extract_path;
+    minotar_batch_callback_t    callback;
+    void*                       context;
+};
+
+/**
+ * A worker's job queue.  The owner pops from the back, thieves take from the front.
+ */
+struct minotar_batch_queue_ {
+    pthread_mutex_t             lock;
+    struct minotar_batch_job_** jobs;
+    size_t                      head;
+    size_t                      count;
+    size_t                      capacity;
+};
+
+/**
+ * Input buffers are handed out from a free list and allocated on first use, up to
+ * the memory budget.
+ */
+struct minotar_batch_buffer_ {
+    struct minotar_batch_buffer_* next;
+};
+
+struct minotar_batch_worker_ {
+    struct minotar_batch_*      batch;
+    size_t                      index;
+    pthread_t                   thread;
+    struct minotar_batch_queue_ queue;
+};
+
+struct minotar_batch_ {
+    minotar_batch_config_t          config;
+    struct minotar_batch_worker_*   workers;
+    size_t                          worker_count;
+    size_t                          threads_started;
+    size_t                          next_queue;     // round robin target for submissions
+
+    pthread_mutex_t                 lock;           // guards everything below
+    pthread_cond_t                  work_ready;     // a job was queued or shutting down
+    pthread_cond_t                  resources_free; // a buffer or file descriptors came back
+    pthread_cond_t                  idle;           // nothing queued or running
+    size_t                          queued;
+    size_t                          running;
+    size_t                          buffers_allocated;
+    size_t                          max_buffers;
+    struct minotar_batch_buffer_*   free_buffers;
+    size_t                          open_files;
+    minotar_error_t                 error;
+    bool                            shutdown;
+};
+
+
+// ---------------- FORWARD DECLARATIONS ----------------------
+
+static void* minotar_batch_worker(void* arg);
+static struct minotar_batch_job_* minotar_batch_take(struct minotar_batch_worker_* worker);
+static minotar_error_t minotar_batch_extract(struct minotar_batch_* batch, struct minotar_batch_job_* job, char* buffer);
+static char* minotar_batch_acquire(struct minotar_batch_* batch);
+static void minotar_batch_release(struct minotar_batch_* batch, char* buffer);
+
+
+// ------------------ INLINE FUNCTIONS ------------------------
+
+/**
+ * Push a job on the back of a queue.
+ *
+ * @return This function returns false when the queue could not grow.
+ */
+static inline bool minotar_batch_queue_push(struct minotar_batch_queue_* queue, struct minotar_batch_job_* job)
+{
+    bool result = true;
+
+    pthread_mutex_lock(&queue->lock);
+
+    if(queue->count == queue->capacity) {
+        size_t capacity = queue->capacity ? queue->capacity * 2 : 16;
+        struct minotar_batch_job_** jobs = malloc(capacity * sizeof(*jobs));
+        if(jobs == NULL) {
+            result = false;
+            goto exit;
+        }
+
+        // unwrap the ring into the new array
+        for(size_t idx = 0; idx < queue->count; ++idx)
+            jobs[idx] = queue->jobs[(queue->head + idx) % queue->capacity];
+
+        free(queue->jobs);
+        queue->jobs = jobs;
+        queue->head = 0;
+        queue->capacity = capacity;
+    }
+
+    queue->jobs[(queue->head + queue->count) % queue->capacity] = job;
+    queue->count++;
+
+exit:
+    pthread_mutex_unlock(&queue->lock);
+    return result;
+}
+
+/**
+ * Take a job off a queue, from the back for the owner or from the front for a thief.
+ *
+ * @return This function returns the job, or NULL if the queue is empty.
+ */
+static inline struct minotar_batch_job_* minotar_batch_queue_pop(struct minotar_batch_queue_* queue, bool steal)
+{
+    struct minotar_batch_job_* job = NULL;
+
+    pthread_mutex_lock(&queue->lock);
+
+    if(queue->count > 0) {
+        if(steal) {
+            job = queue->jobs[queue->head];
+            queue->head = (queue->head + 1) % queue->capacity;
+        }
+        else {
+            job = queue->jobs[(queue->head + queue->count - 1) % queue->capacity];
+        }
+        queue->count--;
+    }
+
+    pthread_mutex_unlock(&queue->lock);
+    return job;
+}
+
+/**
+ * Free a job and its copied paths.
+ */
+static inline void minotar_batch_job_free(struct minotar_batch_job_* job)
+{
+    free(job->input_path);
+    free(job->extract_path);
+    free(job);
+}
+
+
+// ------------------ PUBLIC FUNCTIONS ------------------------
+
+/**
+ * Start a batch service and its worker threads.
+ *
+ * @param config    The configuration, or NULL for the defaults.
+ * @return an error code as defined in the error struct.
+ */
+minotar_error_t minotar_batch_init(minotar_batch_t** p_batch, const minotar_batch_config_t* config)
+{
+    struct minotar_batch_* batch = NULL;
+
+    if(p_batch == NULL)
+        return MINOTAR_invalid_parameter;
+
+    batch = calloc(1, sizeof(*batch));
+    if(batch == NULL)
+        return MINOTAR_out_of_memory;
+
+    if(config != NULL)
+        batch->config = *config;
+
+    if(batch->config.threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        batch->config.threads = cpus > 0 ? (size_t) cpus : 1;
+    }
+    if(batch->config.memory_budget == 0)
+        batch->config.memory_budget = MINOTAR_BATCH_DEFAULT_BUDGET;
+    if(batch->config.max_open_files == 0)
+        batch->config.max_open_files = MINOTAR_BATCH_DEFAULT_OPEN_FILES;
+    if(batch->config.chunk_size == 0)
+        batch->config.chunk_size = MINOTAR_BATCH_DEFAULT_CHUNK_SIZE;
+
+    // the budget has to fit at least one running job.  each job's instance also holds
+    // a write buffer when the profile has one.
+    batch->max_buffers = batch->config.memory_budget / (batch->config.chunk_size + MINOTAR_WRITE_BUFFER_SIZE);
+    if(batch->max_buffers == 0 || batch->config.chunk_size < sizeof(struct minotar_batch_buffer_) ||
+       batch->config.max_open_files < MINOTAR_BATCH_FILES_PER_JOB) {
+        free(batch);
+        return MINOTAR_invalid_parameter;
+    }
+
+    batch->workers = calloc(batch->config.threads, sizeof(*batch->workers));
+    if(batch->workers == NULL) {
+        free(batch);
+        return MINOTAR_out_of_memory;
+    }
+
+    pthread_mutex_init(&batch->lock, NULL);
+    pthread_cond_init(&batch->work_ready, NULL);
+    pthread_cond_init(&batch->resources_free, NULL);
+    pthread_cond_init(&batch->idle, NULL);
+
+    // every queue exists before any worker goes looking for work to steal
+    batch->worker_count = batch->config.threads;
+    for(size_t idx = 0; idx < batch->worker_count; ++idx) {
+        batch->workers[idx].batch = batch;
+        batch->workers[idx].index = idx;
+        pthread_mutex_init(&batch->workers[idx].queue.lock, NULL);
+    }
+
+    // workers that fail to start leave their queue to be stolen from
+    for(size_t idx = 0; idx < batch->worker_count; ++idx) {
+        if(pthread_create(&batch->workers[idx].thread, NULL, minotar_batch_worker, &batch->workers[idx]) != 0)
+            break;
+        batch->threads_started++;
+    }
+
+    *p_batch = batch;
+
+    if(batch->threads_started == 0) {
+        minotar_batch_deinit(p_batch);
+        return MINOTAR_out_of_memory;
+    }
+
+    return MINOTAR_noerror;
+}
+
+/**
+ * Wait for all jobs, stop the worker threads and free the batch service.
+ *
+ * @return an error code as defined in the error struct.
+ */
+minotar_error_t minotar_batch_deinit(minotar_batch_t** p_batch)
+{
+    struct minotar_batch_* batch = NULL;
+
+    if(p_batch == NULL || *p_batch == NULL)
+        return MINOTAR_invalid_parameter;
+
+    batch = *p_batch;
+
+    // workers drain their queues before they see the shutdown
+    pthread_mutex_lock(&batch->lock);
+    batch->shutdown = true;
+    pthread_cond_broadcast(&batch->work_ready);
+    pthread_mutex_unlock(&batch->lock);
+
+    for(size_t idx = 0; idx < batch->threads_started; ++idx)
+        pthread_join(batch->workers[idx].thread, NULL);
+
+    for(size_t idx = 0; idx < batch->worker_count; ++idx) {
+        pthread_mutex_destroy(&batch->workers[idx].queue.lock);
+        free(batch->workers[idx].queue.jobs);
+    }
+
+    while(batch->free_buffers != NULL) {
+        struct minotar_batch_buffer_* buffer = batch->free_buffers;
+        batch->free_buffers = buffer->next;
+        free(buffer);
+    }
+
+    pthread_cond_destroy(&batch->idle);
+    pthread_cond_destroy(&batch->resources_free);
+    pthread_cond_destroy(&batch->work_ready);
+    pthread_mutex_destroy(&batch->lock);
+
+    free(batch->workers);
+    free(batch);
+    *p_batch = NULL;
+
+    return MINOTAR_noerror;
+}
+
+/**
+ * Queue an archive for extraction.  Both paths are copied.
+ *
+ * @param input_path    Path of the tar archive.
+ * @param extract_path  Directory to extract into, or NULL for ./
+ * @param callback      Optional function called when the job is done.
+ * @param context       Passed back to the callback.
+ * @return an error code as defined in the error struct.
+ */
+minotar_error_t minotar_batch_submit(minotar_batch_t* batch, const char* input_path, const char* extract_path,
+                                     minotar_batch_callback_t callback, void* context)
+{
+    struct minotar_batch_job_* job = NULL;
+    size_t target = 0;
+
+    if(batch == NULL || input_path == NULL)
+        return MINOTAR_invalid_parameter;
+
+    job = calloc(1, sizeof(*job));
+    if(job == NULL)
+        return MINOTAR_out_of_memory;
+
+    job->input_path = strdup(input_path);
+    job->extract_path = (extract_path != NULL) ? strdup(extract_path) : NULL;
+    job->callback = callback;
+    job->context = context;
+
+    if(job->input_path == NULL || (extract_path != NULL && job->extract_path == NULL)) {
+        minotar_batch_job_free(job);
+        return MINOTAR_out_of_memory;
+    }
+
+    // spread the jobs over the workers, stealing evens out the rest.  The job is
+    // counted before it is visible so a worker taking it never underflows the count.
+    pthread_mutex_lock(&batch->lock);
+    target = batch->next_queue++ % batch->worker_count;
+    batch->queued++;
+    pthread_mutex_unlock(&batch->lock);
+
+    if(!minotar_batch_queue_push(&batch->workers[target].queue, job)) {
+        pthread_mutex_lock(&batch->lock);
+        batch->queued--;
+        if(batch->queued == 0 && batch->running == 0)
+            pthread_cond_broadcast(&batch->idle);
+        pthread_mutex_unlock(&batch->lock);
+
+        minotar_batch_job_free(job);
+        return MINOTAR_out_of_memory;
+    }
+
+    pthread_mutex_lock(&batch->lock);
+    pthread_cond_signal(&batch->work_ready);
+    pthread_mutex_unlock(&batch->lock);
+
+    return MINOTAR_noerror;
+}
+
+/**
+ * Wait until every queued job is done.
+ *
+ * @return the first error any job ran into since the last wait, or MINOTAR_noerror.
+ */
+minotar_error_t minotar_batch_wait(minotar_batch_t* batch)
+{
+    minotar_error_t error = MINOTAR_noerror;
+
+    if(batch == NULL)
+        return MINOTAR_invalid_parameter;
+
+    pthread_mutex_lock(&batch->lock);
+    while(batch->queued > 0 || batch->running > 0)
+        pthread_cond_wait(&batch->idle, &batch->lock);
+
+    error = batch->error;
+    batch->error = MINOTAR_noerror;
+    pthread_mutex_unlock(&batch->lock);
+
+    return error;
+}
+
+
+// ------------------ PRIVATE FUNCTIONS ------------------------
+
+/**
+ * Find the next job for a worker, its own queue first and then the others.  The job is
+ * counted as running before it leaves the queued count so a wait never sees a gap.
+ *
+ * @return This function returns a job, or NULL when every queue is empty.
+ */
+static struct minotar_batch_job_* minotar_batch_take(struct minotar_batch_worker_* worker)
+{
+    struct minotar_batch_* batch = worker->batch;
+    struct minotar_batch_job_* job = minotar_batch_queue_pop(&worker->queue, false);
+
+    for(size_t idx = 1; job == NULL && idx < batch->worker_count; ++idx) {
+        struct minotar_batch_worker_* victim = &batch->workers[(worker->index + idx) % batch->worker_count];
+        job = minotar_batch_queue_pop(&victim->queue, true);
+    }
+
+    if(job != NULL) {
+        pthread_mutex_lock(&batch->lock);
+        batch->queued--;
+        batch->running++;
+        pthread_mutex_unlock(&batch->lock);
+    }
+
+    return job;
+}
+
+/**
+ * Worker thread.  Runs jobs until the service shuts down and nothing is left queued.
+ */
+static void* minotar_batch_worker(void* arg)
+{
+    struct minotar_batch_worker_* worker = (struct minotar_batch_worker_*) arg;
+    struct minotar_batch_* batch = worker->batch;
+
+    for(;;) {
+        struct minotar_batch_job_* job = minotar_batch_take(worker);
+
+        if(job == NULL) {
+            pthread_mutex_lock(&batch->lock);
+            while(batch->queued == 0 && !batch->shutdown)
+                pthread_cond_wait(&batch->work_ready, &batch->lock);
+
+            bool done = (batch->queued == 0 && batch->shutdown);
+            pthread_mutex_unlock(&batch->lock);
+
+            if(done)
+                break;
+            continue;
+        }
+
+        char* buffer = minotar_batch_acquire(batch);
+        minotar_error_t result = (buffer != NULL) ? minotar_batch_extract(batch, job, buffer) : MINOTAR_out_of_memory;
+        minotar_batch_release(batch, buffer);
+
+        if(job->callback != NULL)
+            job->callback(job->context, job->input_path, result);
+
+        pthread_mutex_lock(&batch->lock);
+        if(batch->error == MINOTAR_noerror)
+            batch->error = result;
+        batch->running--;
+        if(batch->queued == 0 && batch->running == 0)
+            pthread_cond_broadcast(&batch->idle);
+        pthread_mutex_unlock(&batch->lock);
+
+        minotar_batch_job_free(job);
+    }
+
+    return NULL;
+}
+
+/**
+ * Wait for an input buffer and the file descriptors of one job.
+ *
+ * @return This function returns the buffer, or NULL when it could not be allocated.
+ */
+static char* minotar_batch_acquire(struct minotar_batch_* batch)
+{
+    struct minotar_batch_buffer_* buffer = NULL;
+
+    pthread_mutex_lock(&batch->lock);
+
+    while((batch->free_buffers == NULL && batch->buffers_allocated == batch->max_buffers) ||
+          batch->open_files + MINOTAR_BATCH_FILES_PER_JOB > batch->config.max_open_files)
+        pthread_cond_wait(&batch->resources_free, &batch->lock);
+
+    batch->open_files += MINOTAR_BATCH_FILES_PER_JOB;
+
+    if(batch->free_buffers != NULL) {
+        buffer = batch->free_buffers;
+        batch->free_buffers = buffer->next;
+    }
+    else {
+        batch->buffers_allocated++;
+    }
+
+    pthread_mutex_unlock(&batch->lock);
+
+    // allocate outside the lock, the slot is already reserved
+    if(buffer == NULL) {
+        buffer = malloc(batch->config.chunk_size);
+        if(buffer == NULL) {
+            pthread_mutex_lock(&batch->lock);
+            batch->buffers_allocated--;
+            batch->open_files -= MINOTAR_BATCH_FILES_PER_JOB;
+            pthread_cond_signal(&batch->resources_free);
+            pthread_mutex_unlock(&batch->lock);
+        }
+    }
+
+    return (char*) buffer;
+}
+
+/**
+ * Return a job's input buffer and file descriptors.
+ */
+static void minotar_batch_release(struct minotar_batch_* batch, char* buffer)
+{
+    if(buffer == NULL)
+        return;
+
+    pthread_mutex_lock(&batch->lock);
+
+    ((struct minotar_batch_buffer_*) buffer)->next = batch->free_buffers;
+    batch->free_buffers = (struct minotar_batch_buffer_*) buffer;
+    batch->open_files -= MINOTAR_BATCH_FILES_PER_JOB;
+
+    pthread_cond_signal(&batch->resources_free);
+    pthread_mutex_unlock(&batch->lock);
+}
+
+/**
+ * Extract one archive, reading it through the given buffer.
+ *
+ * @return an error code as defined in the error struct.
+ */
+static minotar_error_t minotar_batch_extract(struct minotar_batch_* batch, struct minotar_batch_job_* job, char* buffer)
+{
+    minotar_t* instance = NULL;
+    minotar_error_t error = MINOTAR_noerror;
+    ssize_t read_size = 0;
+    int fd = -1;
+
+    error = minotar_init(&instance);
+    if(error != MINOTAR_noerror)
+        return error;
+
+    if(job->extract_path != NULL) {
+        error = minotar_set_extract_directory(instance, job->extract_path);
+        if(error != MINOTAR_noerror)
+            goto exit;
+    }
+
+    fd = open(job->input_path, O_RDONLY);
+    if(fd < 0) {
+        error = MINOTAR_invalid_path;
+        goto exit;
+    }
+
+    while((read_size = read(fd, buffer, batch->config.chunk_size)) != 0) {
+        if(read_size < 0) {
+            if(errno == EINTR)
+                continue;
+            error = MINOTAR_unknown_error;
+            goto exit;
+        }
+
+        error = minotar_decode(instance, buffer, (size_t) read_size);
+        if(error != MINOTAR_noerror)
+            goto exit;
+    }
+
+    if(!minotar_is_end_of_archive(instance))
+        error = MINOTAR_truncated_archive;
+
+exit:
+    if(fd >= 0)
+        close(fd);
+
+    minotar_deinit(&instance);
+    return error;
+}
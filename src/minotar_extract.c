@@ -9,23 +9,75 @@
  * information.
  */
 
+// pwrite() and ftruncate() are POSIX, not C11
+#define _XOPEN_SOURCE 700
+// syscall() for openat2() is not POSIX
+#define _DEFAULT_SOURCE
+
 #include "minotar.h"
 #include "minotar_internal.h"
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#if MINOTAR_HAVE_PROGRESS
+#include <time.h>
+#endif
+#if MINOTAR_HAVE_SIMD && defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Linux 5.6 can resolve a path without ever leaving a directory.  Define
+// MINOTAR_HAVE_OPENAT2 to 0 to always use the fallback.
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/openat2.h>)
+#include <linux/openat2.h>
+#include <sys/syscall.h>
+#ifndef MINOTAR_HAVE_OPENAT2
+#define MINOTAR_HAVE_OPENAT2 1
+#endif
+#endif
+#endif
+#ifndef MINOTAR_HAVE_OPENAT2
+#define MINOTAR_HAVE_OPENAT2 0
+#endif
 
 
 // ---------------- FORWARD DECLARATIONS ----------------------
 
-static bool minotar_header_verify_checksum(minotar_t* instance);
+static bool minotar_header_verify_checksum(const char* block);
 static size_t minotar_header_get_path_length(minotar_t* instance);
-static void minotar_header_parse_path(minotar_t* instance, char* filename, size_t fnamelen);
+static bool minotar_header_parse_path(minotar_t* instance, char* filename);
 static bool minotar_create_file(minotar_t* instance);
 static bool minotar_parse_record_block(minotar_t* instance);
+static bool minotar_header_validate(minotar_t* instance);
+#if MINOTAR_HAVE_EXTENSIONS
+static bool minotar_parse_sparse_extension(minotar_t* instance);
+static bool minotar_sparse_push(minotar_t* instance, uint64_t value);
+#endif
+static size_t minotar_write(minotar_t* instance, const char* bytes, size_t length);
+static bool minotar_write_flush(minotar_t* instance);
+static bool minotar_begin_entry(minotar_t* instance);
+static bool minotar_close_file(minotar_t* instance);
+static void minotar_end_entry(minotar_t* instance);
+static void minotar_end_record(minotar_t* instance);
+static void minotar_check_record_end(minotar_t* instance, size_t header_size);
+static size_t minotar_parse_header(minotar_t* instance, const char* bytes, size_t length);
+static size_t minotar_parse_header_in_place(minotar_t* instance, const char* bytes, size_t length);
+#if MINOTAR_HAVE_EXTENSIONS
+static size_t minotar_parse_pax_header(minotar_t* instance, const char* bytes, size_t length);
+static size_t minotar_parse_sparse_map(minotar_t* instance, const char* bytes, size_t length);
+#endif
+static size_t minotar_parse_payload(minotar_t* instance, const char* bytes, size_t length);
+static size_t minotar_parse_trailer(minotar_t* instance, const char* bytes, size_t length);
 static size_t minotar_parse(minotar_t* instance, const char* bytes, size_t length);
+#if MINOTAR_HAVE_PROGRESS
+static void minotar_progress_sample(minotar_t* instance, uint64_t start_ns, size_t bytes);
+#endif
 
 
 // ------------------ INLINE FUNCTIONS ------------------------
@@ -35,9 +87,10 @@ static size_t minotar_parse(minotar_t* instance, const char* bytes, size_t lengt
  */
 static inline uint64_t minotar_get_file_size(minotar_t* instance)
 {
-    // File size is 6 bytes of ascii representing octal
-    // followed by one byte of ' ' and ending with '\0'
-    return strtoul(instance->tarball_record_block->size, NULL, 8);
+    // File size is 11 bytes of ascii representing octal
+    // followed by one byte of ' ' or '\0'
+    return minotar_parse_numeric(instance->tarball_record_block->size,
+                                 sizeof(instance->tarball_record_block->size));
 }
 
 /**
@@ -89,12 +142,88 @@ static inline dev_t minotar_header_get_device_version(minotar_t* instance)
     return (dev_t) major << 32 & minor;
 }
 
+/**
+ * Forget the PAX attributes once the entry they describe is complete.
+ */
+static inline void minotar_pax_clear(minotar_t* instance)
+{
+#if MINOTAR_HAVE_EXTENSIONS
+    instance->pax.path_length = 0;
+    instance->pax.path_from_sparse = false;
+#else
+    (void) instance;
+#endif
+}
+
+/**
+ * Forget the sparse map once the entry it describes is complete.  The map storage is
+ * kept for the next sparse entry.
+ */
+static inline void minotar_sparse_clear(minotar_t* instance)
+{
+#if MINOTAR_HAVE_EXTENSIONS
+    struct minotar_sparse_segment_* map = instance->sparse.map;
+    size_t capacity = instance->sparse.capacity;
+
+    memset(&instance->sparse, 0, sizeof(instance->sparse));
+    instance->sparse.map = map;
+    instance->sparse.capacity = capacity;
+#else
+    (void) instance;
+#endif
+}
+
+/**
+ * @return This function returns the length of the PAX path override, 0 when there is none.
+ */
+static inline size_t minotar_pax_path_length(minotar_t* instance)
+{
+#if MINOTAR_HAVE_EXTENSIONS
+    return instance->pax.path_length;
+#else
+    (void) instance;
+    return 0;
+#endif
+}
+
+#if MINOTAR_HAVE_PROGRESS
+/**
+ * @return This function returns a monotonic time in nanoseconds.
+ */
+static inline uint64_t minotar_now_ns(void)
+{
+    struct timespec ts = {0};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+#endif
+
+/**
+ * Close the directories kept open below the extract directory.
+ */
+static inline void minotar_close_directories(minotar_t* instance)
+{
+    if(instance->parent_fd >= 0)
+        close(instance->parent_fd);
+    if(instance->root_fd >= 0)
+        close(instance->root_fd);
+
+    instance->parent_fd = -1;
+    instance->root_fd = -1;
+}
+
+#if !MINOTAR_HAVE_HEAP
+// without a heap the library owns exactly one instance
+static minotar_t minotar_static_instance;
+static bool minotar_static_instance_used;
+#endif
+
 
 // ------------------ PUBLIC FUNCTIONS ------------------------
 
 /**
- * Initialize the Minotar library.  This function allocates 560 bytes of data for
- * the interal structure.
+ * Initialize the Minotar library.  This function allocates the interal structure.
+ * Sparse maps and PAX paths are allocated on demand as archives need them.
  * 
  * @return an error code as defined in the error struct.
  */
@@ -103,13 +232,33 @@ minotar_error_t minotar_init(minotar_t** p_instance)
     if(p_instance == NULL)
         return MINOTAR_invalid_parameter;
     
-    *p_instance = (minotar_t*) malloc(sizeof(minotar_t));
+#if MINOTAR_HAVE_HEAP
+    *p_instance = (minotar_t*) calloc(1, sizeof(minotar_t));
+#else
+    *p_instance = NULL;
+    if(!minotar_static_instance_used) {
+        memset(&minotar_static_instance, 0, sizeof(minotar_static_instance));
+        minotar_static_instance_used = true;
+        *p_instance = &minotar_static_instance;
+    }
+#endif
     
     if(*p_instance == NULL)
         return MINOTAR_out_of_memory;
         
+#if MINOTAR_WRITE_BUFFER_SIZE > 0
+    (*p_instance)->write_buffer = (char*) malloc(MINOTAR_WRITE_BUFFER_SIZE);
+    if((*p_instance)->write_buffer == NULL) {
+        free(*p_instance);
+        *p_instance = NULL;
+        return MINOTAR_out_of_memory;
+    }
+#endif
     
-    (*p_instance)->tarball_record_block = (struct header_posix_ustar*) (*p_instance)->record_header_buf;
+    (*p_instance)->fd = -1;
+    (*p_instance)->root_fd = -1;
+    (*p_instance)->parent_fd = -1;
+    (*p_instance)->tarball_record_block = (const struct header_posix_ustar*) (*p_instance)->record_header_buf;
     
     return MINOTAR_noerror;
 }
@@ -124,10 +273,25 @@ minotar_error_t minotar_deinit(minotar_t** p_instance)
     if(p_instance == NULL || *p_instance == NULL)
         return MINOTAR_invalid_parameter;
     
-    if((*p_instance)->file != NULL)
-        fclose((*p_instance)->file);
+    if((*p_instance)->fd >= 0)
+        close((*p_instance)->fd);
+    minotar_close_directories(*p_instance);
     
+#if MINOTAR_WRITE_BUFFER_SIZE > 0
+    free((*p_instance)->write_buffer);
+#endif
+#if MINOTAR_HAVE_HEAP
+    free((*p_instance)->parent_path);
+#endif
+#if MINOTAR_HAVE_EXTENSIONS
+    free((*p_instance)->pax.path);
+    free((*p_instance)->sparse.map);
+#endif
+#if MINOTAR_HAVE_HEAP
     free(*p_instance);
+#else
+    minotar_static_instance_used = false;
+#endif
     *p_instance = NULL;
     
     return MINOTAR_noerror;
@@ -147,7 +311,8 @@ minotar_error_t minotar_set_extract_directory(minotar_t* instance, const char* p
     if(instance == NULL || path == NULL)
         return MINOTAR_invalid_parameter;
     
-    if(instance->rx_byte_offset != 0)
+    // between archives of a concatenated stream is fine too
+    if(instance->rx_byte_offset != 0 && instance->state != MINOTAR_STATE_trailer)
         return MINOTAR_set_path_before_decode;
         
     
@@ -155,11 +320,125 @@ minotar_error_t minotar_set_extract_directory(minotar_t* instance, const char* p
     if(stat(path, &st) == -1)
         return MINOTAR_invalid_path;
         
+    // the directory is opened with the first entry extracted into it
+    minotar_close_directories(instance);
     instance->extract_path = path;
     
     return MINOTAR_noerror;
 }
 
+#if MINOTAR_HAVE_EXTENSIONS
+/**
+ * Turn runs of zeros in ordinary files into holes instead of writing them out.
+ *
+ * @param enable    true to detect zero runs, false to write every byte.
+ * @return an error code as defined in the error struct.
+ */
+minotar_error_t minotar_set_sparse_detection(minotar_t* instance, bool enable)
+{
+    if(instance == NULL)
+        return MINOTAR_invalid_parameter;
+
+    instance->sparse_detection = enable;
+
+    return MINOTAR_noerror;
+}
+#endif
+
+/**
+ * Keep decoding after the end of archive marker and treat the next non-zero block as
+ * the start of another archive.
+ * 
+ * @param enable    true to extract every archive in the stream, false to stop after the first.
+ * @return an error code as defined in the error struct.
+ */
+minotar_error_t minotar_set_concatenated(minotar_t* instance, bool enable)
+{
+    if(instance == NULL)
+        return MINOTAR_invalid_parameter;
+    
+    instance->concatenated = enable;
+    
+    return MINOTAR_noerror;
+}
+
+/**
+ * Register a function called each time the end of an archive is reached.
+ * 
+ * @param callback  The function to call, or NULL.
+ * @param context   Passed back to the callback.
+ * @return an error code as defined in the error struct.
+ */
+minotar_error_t minotar_set_archive_callback(minotar_t* instance, minotar_archive_callback_t callback, void* context)
+{
+    if(instance == NULL)
+        return MINOTAR_invalid_parameter;
+    
+    instance->archive_callback = callback;
+    instance->archive_context = context;
+    
+    return MINOTAR_noerror;
+}
+
+/**
+ * @return true once the end of archive marker has been decoded and no other archive
+ *         has started since.
+ */
+bool minotar_is_end_of_archive(minotar_t* instance)
+{
+    return instance != NULL && instance->state == MINOTAR_STATE_trailer;
+}
+
+/**
+ * Check the archive instead of extracting it.
+ * 
+ * @param enable    true to only validate, false to extract.
+ * @return an error code as defined in the error struct.
+ */
+minotar_error_t minotar_set_validate_only(minotar_t* instance, bool enable)
+{
+    if(instance == NULL)
+        return MINOTAR_invalid_parameter;
+    
+    instance->validate_only = enable;
+    
+    return MINOTAR_noerror;
+}
+
+/**
+ * Tell Minotar how long the input stream is, when it is known.
+ * 
+ * @param length    The length of the whole stream in bytes, or 0 if unknown.
+ * @return an error code as defined in the error struct.
+ */
+minotar_error_t minotar_set_input_length(minotar_t* instance, uint64_t length)
+{
+    if(instance == NULL)
+        return MINOTAR_invalid_parameter;
+    
+    instance->input_length = length;
+    
+    return MINOTAR_noerror;
+}
+
+/**
+ * Register a function that sees the data of every file, for hashing.
+ * 
+ * @param callback  The function to call, or NULL.
+ * @param context   Passed back to the callback.
+ * @return an error code as defined in the error struct.
+ */
+minotar_error_t minotar_set_payload_callback(minotar_t* instance, minotar_payload_callback_t callback, void* context)
+{
+    if(instance == NULL)
+        return MINOTAR_invalid_parameter;
+    
+    instance->payload_callback = callback;
+    instance->payload_context = context;
+    
+    return MINOTAR_noerror;
+}
+
 /**
  * @brief Reset this instance of minotar.  
  * A reset clears all errors and expects the beginning of a record block as its first
@@ -173,19 +452,146 @@ minotar_error_t minotar_reset(minotar_t* instance)
         return MINOTAR_invalid_parameter;
     
     instance->bytes_remaining = 0;
+    instance->padding_remaining = 0;
     instance->rx_byte_offset = 0;
+    instance->state = MINOTAR_STATE_header;
     instance->error = MINOTAR_noerror;
-    instance->record_header_complete = false;
-    if(instance->file != NULL)
-        fclose(instance->file);
+    instance->zero_blocks = 0;
+    instance->archive_count = 0;
+    instance->stream_offset = 0;
+#if MINOTAR_HAVE_PROGRESS
+    instance->sample_offset = 0;
+    instance->sample_bytes = 0;
+    instance->sample_ns = 0;
+    instance->progress_archives = 0;
+    instance->entries_completed = 0;
+#endif
+    instance->finish_pending = false;
+#if MINOTAR_WRITE_BUFFER_SIZE > 0
+    instance->write_buffered = 0;
+#endif
+    if(instance->fd >= 0)
+        close(instance->fd);
     
-    instance->file = NULL;
+    instance->fd = -1;
+
+    minotar_pax_clear(instance);
+    minotar_sparse_clear(instance);
     
     // clear the data in the header
     memset(instance->record_header_buf, 0, sizeof(instance->record_header_buf));
     return MINOTAR_noerror;
 }
 
+/**
+ * Hand payload writes to a custom sink instead of writing the files directly.
+ *
+ * @param sink  The sink to use, or NULL to go back to writing files directly.
+ * @return an error code as defined in the error struct.
+ */
+minotar_error_t minotar_set_sink(minotar_t* instance, const minotar_sink_t* sink)
+{
+    if(instance == NULL)
+        return MINOTAR_invalid_parameter;
+
+    if(sink == NULL)
+        memset(&instance->sink, 0, sizeof(instance->sink));
+    else
+        instance->sink = *sink;
+
+    return MINOTAR_noerror;
+}
+
+/**
+ * @return the file descriptor to wait on before resuming a blocked decode, or -1.
+ */
+int minotar_get_poll_fd(minotar_t* instance)
+{
+    if(instance == NULL || instance->sink.poll_fd == NULL)
+        return -1;
+
+    return instance->sink.poll_fd(instance->sink.context);
+}
+
+#if MINOTAR_HAVE_PROGRESS
+/**
+ * Register a function that reports progress.
+ * 
+ * @param callback      The function to call, or NULL.
+ * @param context       Passed back to the callback.
+ * @param interval_ms   The least time between two calls.
+ * @return an error code as defined in the error struct.
+ */
+minotar_error_t minotar_set_progress_callback(minotar_t* instance, minotar_progress_callback_t callback,
+                                              void* context, uint32_t interval_ms)
+{
+    if(instance == NULL)
+        return MINOTAR_invalid_parameter;
+    
+    instance->progress_callback = callback;
+    instance->progress_context = context;
+    instance->progress_interval_ns = (uint64_t) interval_ms * 1000000u;
+    
+    return MINOTAR_noerror;
+}
+
+/**
+ * Get the progress of the decode.
+ * 
+ * @param progress  Filled in with the current progress.
+ * @return an error code as defined in the error struct.
+ */
+minotar_error_t minotar_get_progress(minotar_t* instance, minotar_progress_t* progress)
+{
+    if(instance == NULL || progress == NULL)
+        return MINOTAR_invalid_parameter;
+    
+    memset(progress, 0, sizeof(*progress));
+    progress->bytes_consumed = instance->stream_offset;
+    progress->total_bytes = instance->input_length;
+    progress->throughput = instance->throughput;
+    progress->entries_completed = instance->entries_completed;
+    
+    // the header of the entry is intact for as long as its data is being written
+    if(instance->state != MINOTAR_STATE_payload)
+        return MINOTAR_noerror;
+    
+#if MINOTAR_HAVE_EXTENSIONS
+    if(instance->pax.path_length > 0) {
+        progress->entry = instance->pax.path;
+        progress->entry_length = instance->pax.path_length;
+        return MINOTAR_noerror;
+    }
+#endif
+    
+    progress->entry = instance->tarball_record_block->name;
+    progress->entry_length = strnlen(instance->tarball_record_block->name, sizeof(instance->tarball_record_block->name));
+    
+    return MINOTAR_noerror;
+}
+#endif
+
+/**
+ * Suggest how many bytes to pass to the next decode.
+ * 
+ * @return the recommended chunk size in bytes.
+ */
+size_t minotar_recommended_chunk_size(minotar_t* instance)
+{
+    uint64_t chunk_size = MINOTAR_CHUNK_DEFAULT;
+    
+#if MINOTAR_HAVE_PROGRESS
+    if(instance != NULL && instance->throughput > 0)
+        chunk_size = instance->throughput / (1000000 / MINOTAR_CHUNK_TARGET_US);
+#else
+    (void) instance;
+#endif
+    
+    chunk_size = MINOTAR_MIN(MINOTAR_MAX(chunk_size, MINOTAR_CHUNK_MIN), MINOTAR_CHUNK_MAX);
+    
+    return (size_t) (chunk_size & ~(uint64_t) (RECORD_BLOCK_ROUNDOFF - 1));
+}
+
 /**
  * Decode the next block of data.  This function automatically writes the file to disk.
  * 
@@ -195,20 +601,85 @@ minotar_error_t minotar_reset(minotar_t* instance)
  */
 minotar_error_t minotar_decode(minotar_t* instance, const char* bytes, size_t length)
 {
+    minotar_error_t error = MINOTAR_noerror;
     size_t parsed = 0;
+    size_t consumed = 0;
     
     if(instance == NULL || bytes == NULL)
         return MINOTAR_invalid_parameter;
     
+    // wait out any backpressure from the sink until the whole buffer is taken
+    while((error = minotar_decode_nonblocking(instance, &bytes[parsed], length - parsed, &consumed)) == MINOTAR_would_block) {
+        struct pollfd pfd = { .fd = minotar_get_poll_fd(instance), .events = POLLOUT };
+        parsed += consumed;
+        
+        // without a readiness fd just back off for a millisecond
+        poll(&pfd, pfd.fd >= 0 ? 1 : 0, pfd.fd >= 0 ? -1 : 1);
+    }
+    
+    return error;
+}
+
+/**
+ * Decode as much of the next block of data as the sink will take.
+ * 
+ * @param bytes     A buffer of bytes as it comes in from the file.
+ * @param length    the length of buffer bytes.
+ * @param consumed  Set to the number of bytes accepted.
+ * @return an error code as defined in the error struct.
+ */
+minotar_error_t minotar_decode_nonblocking(minotar_t* instance, const char* bytes, size_t length, size_t* consumed)
+{
+#if MINOTAR_HAVE_PROGRESS
+    uint64_t start_ns = 0;
+#endif
+    size_t parsed = 0;
+    
+    if(instance == NULL || bytes == NULL || consumed == NULL)
+        return MINOTAR_invalid_parameter;
+    
+    instance->blocked = false;
+    
+#if MINOTAR_HAVE_PROGRESS
+    // the clock is only read around a decode every so often, and around every one
+    // until a rate has been measured
+    if(instance->throughput == 0 || instance->stream_offset - instance->sample_offset >= MINOTAR_SAMPLE_BYTES)
+        start_ns = minotar_now_ns();
+#endif
+    
+    // the last file of an earlier decode is still waiting on the sink
+    if(instance->finish_pending && instance->error == MINOTAR_noerror)
+        minotar_end_entry(instance);
+    
     // Recursively call the parse function to work our way through all the data.
     // Of course, this is meant for embedded so lets use loop based recursion.
-    while(instance->error == MINOTAR_noerror && parsed < length) {
-        parsed += minotar_parse(instance, &bytes[parsed], length - parsed);
+    while(instance->error == MINOTAR_noerror && !instance->blocked && parsed < length) {
+        size_t parse_size;
+        // a header the input holds whole is read from there instead of being copied
+        if(instance->state == MINOTAR_STATE_header && instance->rx_byte_offset == 0 &&
+           length - parsed >= RECORD_BLOCK_ROUNDOFF)
+            parse_size = minotar_parse_header_in_place(instance, &bytes[parsed], length - parsed);
+        else
+            parse_size = minotar_parse(instance, &bytes[parsed], length - parsed);
+        parsed += parse_size;
+        instance->stream_offset += parse_size;
         if(parsed > length) {
             instance->error = MINOTAR_unknown_error;
         }
     }
     
+    *consumed = parsed;
+    
+    // only time spent in here is measured, whatever the caller does between decodes
+    // to produce the data is not
+#if MINOTAR_HAVE_PROGRESS
+    if(start_ns != 0 || instance->archive_count != instance->progress_archives)
+        minotar_progress_sample(instance, start_ns, parsed);
+#endif
+    
+    if(instance->error == MINOTAR_noerror && instance->blocked)
+        return MINOTAR_would_block;
+    
     return instance->error;
 }
 
@@ -218,25 +689,25 @@ minotar_error_t minotar_decode(minotar_t* instance, const char* bytes, size_t le
 
 /**
  * 
- * @return This function returns the full path length.
+ * @return This function returns the length of the path inside the extract directory
+ *         including the null byte.
  */
 static size_t minotar_header_get_path_length(minotar_t* instance)
 {
     const size_t max_prefix_length = sizeof(instance->tarball_record_block->prefix);
     const size_t max_name_length = sizeof(instance->tarball_record_block->name);
-    size_t length = 0;
-    
-    if(instance->extract_path != NULL) {
-        length += strlen(instance->extract_path);
-        length += 1; // add 1 for added '/'
-    }
+    size_t length = 1; // null byte
     
-    if(minotar_header_has_extended_path(instance)) {
-        length += MINOTAR_MIN(strlen(instance->tarball_record_block->prefix), max_prefix_length);
+    // a PAX path replaces the name and prefix fields entirely
+    if(minotar_pax_path_length(instance) > 0)
+        return length + minotar_pax_path_length(instance);
+
+    if(minotar_header_has_extended_path(instance) && instance->tarball_record_block->prefix[0] != '\0') {
+        length += strnlen(instance->tarball_record_block->prefix, max_prefix_length);
         length += 1; // add 1 for added '/'
     }
     
-    length += MINOTAR_MIN(strlen(instance->tarball_record_block->name), max_name_length);
+    length += strnlen(instance->tarball_record_block->name, max_name_length);
     
     return length;
 }
@@ -246,27 +717,49 @@ static size_t minotar_header_get_path_length(minotar_t* instance)
  * weird quirk... the header checksum isnt defined as signed or unsigned so different
  * implemetations use whatever they feel like.  So we need to test both.
  * 
+ * @param block     The 512 byte header block, which is left untouched.
  * @return This function returns the boolean validity of the checksum.
  */
-static bool minotar_header_verify_checksum(minotar_t* instance)
+static bool minotar_header_verify_checksum(const char* block)
 {
     bool result = false;
+    const struct header_posix_ustar* header = (const struct header_posix_ustar*) block;
+    const size_t checksum_length = sizeof(header->checksum);
        
     // Checksum is 6 bytes of octal one byte of ' ' and ending with '\0'
-    uint32_t rx_checksum = strtoul(instance->tarball_record_block->checksum, NULL, 8);
+    uint32_t rx_checksum = (uint32_t) minotar_parse_numeric(header->checksum, checksum_length);
     int32_t rx_schecksum = (int32_t) rx_checksum;
     uint32_t calc_checksum = 0;
     int32_t calc_schecksum = 0;
 
-    // the the checksum assumes that the 8 bytes allocated
-    // for checksum are assigned ascii ' ' or 0x30
-    const size_t checksum_length = sizeof(instance->tarball_record_block->checksum);
-    memset(instance->tarball_record_block->checksum, ' ', checksum_length);
-
+#if MINOTAR_HAVE_SIMD && defined(__SSE2__)
+    // sum 16 bytes at a time.  The signed sum is the unsigned one less 256 for every
+    // byte with the high bit set.
+    const __m128i zero = _mm_setzero_si128();
+    __m128i sum = zero;
+    __m128i high = zero;
+    for(size_t idx = 0; idx < RECORD_BLOCK_ROUNDOFF; idx += 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i*) &block[idx]);
+        sum = _mm_add_epi64(sum, _mm_sad_epu8(bytes, zero));
+        high = _mm_add_epi64(high, _mm_sad_epu8(_mm_srli_epi16(_mm_and_si128(bytes, _mm_set1_epi8((char) 0x80)), 7), zero));
+    }
+    sum = _mm_add_epi64(sum, _mm_unpackhi_epi64(sum, sum));
+    high = _mm_add_epi64(high, _mm_unpackhi_epi64(high, high));
+    calc_checksum = (uint32_t) _mm_cvtsi128_si32(sum);
+    calc_schecksum = (int32_t) calc_checksum - 256 * _mm_cvtsi128_si32(high);
+#else
     // add all the signed and unsigned bytes of the header simultaniously
-    for(size_t idx = 0; idx < sizeof(instance->record_header_buf); ++idx) {
-        calc_checksum += (uint8_t) instance->record_header_buf[idx];
-        calc_schecksum += instance->record_header_buf[idx];
+    for(size_t idx = 0; idx < RECORD_BLOCK_ROUNDOFF; ++idx) {
+        calc_checksum += (uint8_t) block[idx];
+        calc_schecksum += (int8_t) block[idx];
+    }
+#endif
+
+    // the the checksum assumes that the 8 bytes allocated
+    // for checksum are assigned ascii ' ' or 0x20, so swap them in
+    for(size_t idx = 0; idx < checksum_length; ++idx) {
+        calc_checksum += (uint32_t) ' ' - (uint8_t) header->checksum[idx];
+        calc_schecksum += (int32_t) ' ' - (int8_t) header->checksum[idx];
     }
 
     // if either of the checksums match, we have a valid checksum
@@ -277,58 +770,301 @@ static bool minotar_header_verify_checksum(minotar_t* instance)
 }
 
 /**
- * This function appends the relative path + file name.
+ * Append a path from the archive one component at a time.  Leading '/', empty and "."
+ * components are dropped so the path is always relative to the extract directory.
+ * Every component appended is followed by a '/'.
  * 
- * @param filename  a pointer to a char buffer into which we will write the file name
- * @param fnamelen  the size of the filename buffer
+ * @param p_out     Where to append the path and advanced past it, or NULL to only check it.
+ * @return This function returns false when a ".." component would leave the extract directory.
  */
-static void minotar_header_parse_path(minotar_t* instance, char* filename, size_t fnamelen)
+static bool minotar_path_normalize(const char* path, size_t length, char** p_out)
 {
-    // prepend the root directory if we have one
-    if(instance->extract_path != NULL) {
-        // assign the file path the the name
-        int extract_dir_size = snprintf(filename, fnamelen, "%s/", instance->extract_path);
-        filename += extract_dir_size - 1; // subtract 1 to eliminate null byte
-        fnamelen -= extract_dir_size - 1;
-    }
-    
-    // extended header path prefix gets added first follwed by a /
-    if(minotar_header_has_extended_path(instance)) {
-        // assign the file path the the name
-        int prefix_size = snprintf(filename, fnamelen, "%s/", instance->tarball_record_block->prefix);
-        filename += prefix_size - 1; // subtract 1 to eliminate null byte
-        fnamelen -= prefix_size - 1;
+    size_t idx = 0;
+
+    while(idx < length && path[idx] != '\0') {
+        size_t start = idx;
+        while(idx < length && path[idx] != '\0' && path[idx] != '/')
+            ++idx;
+
+        size_t component_length = idx - start;
+        if(idx < length && path[idx] == '/')
+            ++idx;
+
+        if(component_length == 0 || (component_length == 1 && path[start] == '.'))
+            continue;
+
+        if(component_length == 2 && path[start] == '.' && path[start + 1] == '.')
+            return false;
+
+        if(p_out != NULL) {
+            memcpy(*p_out, &path[start], component_length);
+            *p_out += component_length;
+            *(*p_out)++ = '/';
+        }
     }
 
-    // append the filename
-    snprintf(filename, fnamelen, "%s", instance->tarball_record_block->name);
+    return true;
 }
 
 /**
- * Create the next file in the tarball.
+ * This function writes the path of the current entry relative to the extract directory.
+ * The buffer must hold minotar_header_get_path_length() bytes.
  * 
- * @return This function returns whether the file was successfully created.
+ * @param filename  a pointer to a char buffer into which we will write the file name
+ * @return This function returns false when the path leaves the extract directory.
  */
-static bool minotar_create_file(minotar_t* instance)
+static bool minotar_header_parse_path(minotar_t* instance, char* filename)
 {
-    int result = 0;
-    mode_t mode = {0};
-    dev_t ver = {0};
-    char* path = NULL;
-    size_t path_length = 0;
-    // gid_t groupid = {0};
-    // uid_t userid = {0};
-    
-    if(instance == NULL) return false;
+    const size_t max_prefix_length = sizeof(instance->tarball_record_block->prefix);
+    const size_t max_name_length = sizeof(instance->tarball_record_block->name);
+    char* end = filename;
+    bool result = true;
+
+#if MINOTAR_HAVE_EXTENSIONS
+    // a PAX path replaces the name and prefix fields entirely
+    if(instance->pax.path_length > 0) {
+        result = minotar_path_normalize(instance->pax.path, instance->pax.path_length, &end);
+    }
+    else
+#endif
+    {
+        // extended header path prefix gets added first
+        if(minotar_header_has_extended_path(instance))
+            result = minotar_path_normalize(instance->tarball_record_block->prefix, max_prefix_length, &end);
+
+        result = result && minotar_path_normalize(instance->tarball_record_block->name, max_name_length, &end);
+    }
+
+    // drop the '/' after the last component
+    if(end != filename)
+        --end;
+    *end = '\0';
+
+    return result;
+}
+
+/**
+ * Open a directory below the extract directory.  openat2() refuses to resolve anything
+ * outside of it.  Without openat2() a normalized path can only leave the tree through a
+ * symlink, which may be there before the archive is, so the path is walked a component
+ * at a time without following any.
+ * 
+ * @param path  A normalized path relative to the extract directory.
+ * @return This function returns the directory file descriptor, or -1 with errno set.
+ */
+static int minotar_open_beneath(minotar_t* instance, char* path)
+{
+    const int flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+    int fd = -1;
+
+#if MINOTAR_HAVE_OPENAT2
+    if(!instance->openat2_missing) {
+        struct open_how how = { .flags = flags, .resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS };
+        fd = (int) syscall(SYS_openat2, instance->root_fd, path, &how, sizeof(how));
+        if(fd >= 0 || errno != ENOSYS)
+            return fd;
+
+        // older kernels, remember so the syscall is only tried once
+        instance->openat2_missing = true;
+    }
+#endif
+
+    fd = dup(instance->root_fd);
+    while(fd >= 0 && *path != '\0') {
+        char* slash = strchr(path, '/');
+        if(slash != NULL)
+            *slash = '\0';
+
+        int next = openat(fd, path, flags | O_NOFOLLOW);
+        close(fd);
+        fd = next;
+
+        if(slash == NULL)
+            break;
+        *slash = '/';
+        path = slash + 1;
+    }
+
+    return fd;
+}
+
+/**
+ * Get the directory an entry goes into.  The last directory opened is kept, as
+ * consecutive entries of an archive usually share it.
+ * 
+ * @param path  A normalized path relative to the extract directory.
+ * @param leaf  Where the last component of path starts.
+ * @return This function returns the directory file descriptor, or -1 with errno set.
+ */
+static int minotar_open_parent(minotar_t* instance, char* path, const char* leaf)
+{
+    size_t length = (size_t) (leaf - path);
+    int fd = -1;
+
+    if(instance->root_fd < 0) {
+        const char* root = instance->extract_path != NULL ? instance->extract_path : ".";
+        instance->root_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if(instance->root_fd < 0)
+            return -1;
+    }
+
+    if(length == 0)
+        return instance->root_fd;
+
+#if MINOTAR_HAVE_HEAP
+    if(instance->parent_fd >= 0 && instance->parent_length == length && !memcmp(instance->parent_path, path, length))
+        return instance->parent_fd;
+#endif
+
+    // the trailing '/' of the directory is dropped while it is opened
+    path[length - 1] = '\0';
+    fd = minotar_open_beneath(instance, path);
+    path[length - 1] = '/';
+
+#if MINOTAR_HAVE_HEAP
+    if(fd >= 0) {
+        if(instance->parent_capacity < length) {
+            char* parent_path = realloc(instance->parent_path, length);
+            if(parent_path == NULL)
+                return fd;
+            instance->parent_path = parent_path;
+            instance->parent_capacity = length;
+        }
+
+        if(instance->parent_fd >= 0)
+            close(instance->parent_fd);
+        instance->parent_fd = fd;
+        instance->parent_length = length;
+        memcpy(instance->parent_path, path, length);
+    }
+#endif
+
+    return fd;
+}
+
+/**
+ * Close a directory from minotar_open_parent() unless it is kept open.
+ */
+static void minotar_close_parent(minotar_t* instance, int fd)
+{
+    if(fd >= 0 && fd != instance->root_fd && fd != instance->parent_fd)
+        close(fd);
+}
+
+/**
+ * Hard link the current entry to the earlier entry it names.  The target is resolved
+ * inside the extract directory just like the entry itself.
+ * 
+ * @return This function returns 0 on success, -1 otherwise.
+ */
+static int minotar_create_hard_link(minotar_t* instance, int dir_fd, const char* leaf)
+{
+    char target[sizeof(instance->tarball_record_block->linkname) + 1];
+    char* end = target;
+    int target_dir_fd = -1;
+    int result = -1;
+
+    if(!minotar_path_normalize(instance->tarball_record_block->linkname,
+                               sizeof(instance->tarball_record_block->linkname), &end) || end == target) {
+        instance->error = MINOTAR_invalid_path;
+        return -1;
+    }
+    *--end = '\0';
+
+    const char* target_leaf = strrchr(target, '/');
+    target_leaf = target_leaf != NULL ? target_leaf + 1 : target;
+
+    // the link target's directory is opened on its own so the cached one is kept
+    if(target_leaf == target) {
+        target_dir_fd = instance->root_fd;
+    }
+    else {
+        target[target_leaf - target - 1] = '\0';
+        target_dir_fd = minotar_open_beneath(instance, target);
+    }
+
+    if(target_dir_fd >= 0)
+        result = linkat(target_dir_fd, target_leaf, dir_fd, leaf, 0);
+
+    // replace what an earlier extraction left behind, unless it already is the target
+    if(result != 0 && errno == EEXIST) {
+        struct stat existing = {0};
+        struct stat wanted = {0};
+        if(fstatat(dir_fd, leaf, &existing, AT_SYMLINK_NOFOLLOW) == 0 &&
+           fstatat(target_dir_fd, target_leaf, &wanted, AT_SYMLINK_NOFOLLOW) == 0 &&
+           existing.st_dev == wanted.st_dev && existing.st_ino == wanted.st_ino)
+            result = 0;
+        else if(unlinkat(dir_fd, leaf, 0) == 0)
+            result = linkat(target_dir_fd, target_leaf, dir_fd, leaf, 0);
+    }
+
+    if(target_dir_fd >= 0 && target_dir_fd != instance->root_fd)
+        close(target_dir_fd);
+
+    return result;
+}
+
+/**
+ * Create the next file in the tarball.  Everything is created relative to the extract
+ * directory with the *at() calls, so no entry can land outside of it.
+ * 
+ * @return This function returns whether the file was successfully created.
+ */
+static bool minotar_create_file(minotar_t* instance)
+{
+    int result = 0;
+    mode_t mode = {0};
+    dev_t ver = {0};
+#if MINOTAR_HAVE_HEAP
+    char* path = NULL;
+#else
+    char path[MINOTAR_PATH_MAX];
+#endif
+    size_t path_length = 0;
+    const char* leaf = NULL;
+    int dir_fd = -1;
+    // gid_t groupid = {0};
+    // uid_t userid = {0};
+    
+    if(instance == NULL) return false;
     
     path_length = minotar_header_get_path_length(instance);
+#if MINOTAR_HAVE_HEAP
     path = (char*) malloc(path_length);
     if(path == NULL) {
         instance->error = MINOTAR_out_of_memory;
         return false;
     }
+#else
+    if(path_length > sizeof(path)) {
+        instance->error = MINOTAR_invalid_path;
+        return false;
+    }
+#endif
+    
+    if(!minotar_header_parse_path(instance, path)) {
+        instance->error = MINOTAR_invalid_path;
+        result = -1;
+        goto exit;
+    }
+    
+    // "./" and the like name the extract directory itself
+    if(path[0] == '\0') {
+        if(instance->tarball_record_block->typeflag != FILE_TYPE_directory) {
+            instance->error = MINOTAR_invalid_path;
+            result = -1;
+        }
+        goto exit;
+    }
     
-    minotar_header_parse_path(instance, path, path_length);
+    leaf = strrchr(path, '/');
+    leaf = (leaf != NULL) ? leaf + 1 : path;
+    
+    dir_fd = minotar_open_parent(instance, path, leaf);
+    if(dir_fd < 0) {
+        result = -1;
+        goto exit;
+    }
     
     // get the rest of the file info
     ver = minotar_header_get_device_version(instance);
@@ -339,36 +1075,45 @@ static bool minotar_create_file(minotar_t* instance)
     
     switch(instance->tarball_record_block->typeflag) {
         case FILE_TYPE_hard_link:
-            result = link(instance->tarball_record_block->linkname, path);
-            break;
+            result = minotar_create_hard_link(instance, dir_fd, leaf);
+            goto exit;
         case FILE_TYPE_symlink:
-#if defined (symlink)
-            result = symlink(instance->tarball_record_block->linkname, path);
-#elif defined (mknod)
-            mode |= S_IFLNK;
-            result = mknod(path, mode, 0);
-            result = link(instance->tarball_record_block->linkname, path);
-#endif
-            break;
+            // the target is only ever read by the system, entries are never resolved through it
+            result = symlinkat(instance->tarball_record_block->linkname, dir_fd, leaf);
+            // replace what an earlier extraction left behind.  unlinkat() without
+            // AT_REMOVEDIR never removes a directory, the same goes for the other types.
+            if(result != 0 && errno == EEXIST && unlinkat(dir_fd, leaf, 0) == 0)
+                result = symlinkat(instance->tarball_record_block->linkname, dir_fd, leaf);
+            goto exit;
         case FILE_TYPE_char_special:
 #if defined (mknod)
             mode |= S_IFCHR;
-            result = mknod(path, mode, ver);
+            result = mknodat(dir_fd, leaf, mode, ver);
 #endif
             break;
         case FILE_TYPE_block_special:
 #if defined (mknod)
             mode |=  S_IFBLK;
-            result = mknod(path, mode, ver);
+            result = mknodat(dir_fd, leaf, mode, ver);
 #endif
             break;
         case FILE_TYPE_directory:
-            result = mkdir(path, mode);
+            // directories are shared by the archives of a concatenated stream
+            result = mkdirat(dir_fd, leaf, mode);
+            if(result != 0 && errno == EEXIST) {
+                // but a symlink in place of one must not have its target's mode changed
+                struct stat st = {0};
+                result = fstatat(dir_fd, leaf, &st, AT_SYMLINK_NOFOLLOW);
+                if(result == 0 && !S_ISDIR(st.st_mode))
+                    result = -1;
+            }
             //mode |= S_IFDIR;
             //result = mknod(path, mode, 0);
             break;
         case FILE_TYPE_fifo:
-            result = mkfifo(path, mode);
+            result = mkfifoat(dir_fd, leaf, mode);
+            if(result != 0 && errno == EEXIST && unlinkat(dir_fd, leaf, 0) == 0)
+                result = mkfifoat(dir_fd, leaf, mode);
             //mode |= S_IFIFO;
             //result = mknod(path, mode, 0);
             break;
@@ -377,28 +1122,210 @@ static bool minotar_create_file(minotar_t* instance)
         // This continuous file is unsupported in most UNIX systems so handle it
         // like a normal file.
         case FILE_TYPE_continuous_file:
+#if MINOTAR_HAVE_EXTENSIONS
+        // GNU sparse files are normal files with holes in them
+        case FILE_TYPE_gnu_sparse:
+#endif
         // Handle all unknown types as normal files to maintain POSIX compliance.
         default:
-#if defined (mknod)
-            mode |= S_IFREG;
-            result = mknod(path, mode, 0);
-#else
             (void) ver;
-#endif
-            instance->file = fopen(path, "wb");
-            break;
+            // never write through a symlink, replace it like tar does
+            instance->fd = openat(dir_fd, leaf, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, mode);
+            if(instance->fd < 0 && errno == ELOOP && unlinkat(dir_fd, leaf, 0) == 0)
+                instance->fd = openat(dir_fd, leaf, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, mode);
+            result = (instance->fd < 0) ? -1 : fchmod(instance->fd, mode);
+            goto exit;
     }
     
     // it seems like a poor choice to set the ownership
     // chown(path, userid, groupid);
-    chmod(path, mode);
+    if(result == 0)
+        fchmodat(dir_fd, leaf, mode, 0);
     
+exit:
+    minotar_close_parent(instance, dir_fd);
+    
+#if MINOTAR_HAVE_HEAP
     if(path != NULL)
         free(path);
+#endif
     
     return result == 0;
 }
 
+#if MINOTAR_HAVE_EXTENSIONS
+/**
+ * Append one number to the sparse map.  Numbers alternate between the offset of a
+ * data segment and its length.
+ *
+ * @return This function returns false when the map could not grow.
+ */
+static bool minotar_sparse_push(minotar_t* instance, uint64_t value)
+{
+    struct minotar_sparse_* sparse = &instance->sparse;
+
+    sparse->active = true;
+
+    if(sparse->half) {
+        sparse->map[sparse->count - 1].numbytes = value;
+        sparse->half = false;
+        return true;
+    }
+
+    // the map is bounded for the same reason PAX paths are
+    if(sparse->count == MINOTAR_SPARSE_MAX_SEGMENTS) {
+        instance->error = MINOTAR_header_invalid;
+        return false;
+    }
+
+    if(sparse->count == sparse->capacity) {
+        size_t capacity = sparse->capacity ? sparse->capacity * 2 : 8;
+        struct minotar_sparse_segment_* map = realloc(sparse->map, capacity * sizeof(*map));
+        if(map == NULL) {
+            instance->error = MINOTAR_out_of_memory;
+            return false;
+        }
+        sparse->map = map;
+        sparse->capacity = capacity;
+    }
+
+    sparse->map[sparse->count].offset = value;
+    sparse->map[sparse->count].numbytes = 0;
+    sparse->count++;
+    sparse->half = true;
+
+    return true;
+}
+
+/**
+ * Read the sparse map entries of an old GNU header or extension block.  Unused
+ * entries are zero filled and end the list.
+ *
+ * @return This function returns false when the map could not grow.
+ */
+static bool minotar_sparse_parse_gnu(minotar_t* instance, const struct header_gnu_sparse_entry* entries, size_t count)
+{
+    for(size_t idx = 0; idx < count && entries[idx].offset[0] != '\0'; ++idx) {
+        if(!minotar_sparse_push(instance, minotar_parse_numeric(entries[idx].offset, sizeof(entries[idx].offset))) ||
+           !minotar_sparse_push(instance, minotar_parse_numeric(entries[idx].numbytes, sizeof(entries[idx].numbytes))))
+            return false;
+    }
+
+    return true;
+}
+
+/**
+ * Parse a completed old GNU sparse extension block.
+ *
+ * @return This function returns whether the extension block parsing was successful.
+ */
+static bool minotar_parse_sparse_extension(minotar_t* instance)
+{
+    const struct header_gnu_sparse_extension* extension =
+        (const struct header_gnu_sparse_extension*) instance->record_header_buf;
+
+    instance->rx_byte_offset = 0;
+
+    if(!minotar_sparse_parse_gnu(instance, extension->sparse, sizeof(extension->sparse) / sizeof(extension->sparse[0])))
+        return false;
+
+    // more extension blocks follow, stay in this state
+    if(extension->isextended)
+        return true;
+
+    instance->state = MINOTAR_STATE_payload;
+    if(instance->bytes_remaining == 0)
+        minotar_end_entry(instance);
+
+    return true;
+}
+#endif // MINOTAR_HAVE_EXTENSIONS
+
+/**
+ * Check that a path stays inside the directory it is extracted to: it is not absolute
+ * and has no ".." component.
+ *
+ * @return This function returns true when the path is safe.
+ */
+static bool minotar_path_is_safe(const char* path, size_t length)
+{
+    if(length > 0 && path[0] == '/')
+        return false;
+
+    return minotar_path_normalize(path, length, NULL);
+}
+
+/**
+ * Numeric fields hold octal digits padded with spaces and terminated by ' ' or '\0',
+ * or a GNU base-256 number.
+ *
+ * @return This function returns true when the field is well formed.
+ */
+static bool minotar_field_is_numeric(const char* field, size_t length)
+{
+    size_t idx = 0;
+
+    if(length > 0 && (field[0] & 0x80))
+        return true;
+
+    while(idx < length && field[idx] == ' ')
+        ++idx;
+    while(idx < length && field[idx] >= '0' && field[idx] <= '7')
+        ++idx;
+    while(idx < length && (field[idx] == ' ' || field[idx] == '\0'))
+        ++idx;
+
+    return idx == length;
+}
+
+/**
+ * Sanity check a header beyond its checksum for validate-only mode.
+ *
+ * @return This function returns whether the header is valid.
+ */
+static bool minotar_header_validate(minotar_t* instance)
+{
+    const struct header_posix_ustar* header = instance->tarball_record_block;
+    const bool ustar = !memcmp(header->magic, "ustar\0", 6);
+    const bool gnu = !memcmp(header->magic, "ustar ", 6);
+
+    // PAX headers describe the entry that follows them
+    if(header->typeflag == FILE_TYPE_pax_extended || header->typeflag == FILE_TYPE_pax_global)
+        return true;
+
+    if(!minotar_field_is_numeric(header->mode, sizeof(header->mode)) ||
+       !minotar_field_is_numeric(header->uid, sizeof(header->uid)) ||
+       !minotar_field_is_numeric(header->gid, sizeof(header->gid)) ||
+       !minotar_field_is_numeric(header->size, sizeof(header->size)) ||
+       !minotar_field_is_numeric(header->mtime, sizeof(header->mtime)) ||
+       header->name[0] == '\0') {
+        instance->error = MINOTAR_header_invalid;
+        return false;
+    }
+
+    // ustar, GNU or the original format with no magic at all
+    if(!ustar && !gnu && !minotar_is_zero(header->magic, sizeof(header->magic))) {
+        instance->error = MINOTAR_header_invalid;
+        return false;
+    }
+
+#if MINOTAR_HAVE_EXTENSIONS
+    if(instance->pax.path_length > 0 && !minotar_path_is_safe(instance->pax.path, instance->pax.path_length)) {
+        instance->error = MINOTAR_invalid_path;
+        return false;
+    }
+#endif
+
+    if((minotar_pax_path_length(instance) == 0 && !minotar_path_is_safe(header->name, sizeof(header->name))) ||
+       (minotar_pax_path_length(instance) == 0 && ustar && !minotar_path_is_safe(header->prefix, sizeof(header->prefix))) ||
+       (header->typeflag == FILE_TYPE_hard_link && !minotar_path_is_safe(header->linkname, sizeof(header->linkname)))) {
+        instance->error = MINOTAR_invalid_path;
+        return false;
+    }
+
+    return true;
+}
+
 /**
  * Parse a completed record block header.
  * 
@@ -406,77 +1333,853 @@ static bool minotar_create_file(minotar_t* instance)
  */
 static bool minotar_parse_record_block(minotar_t* instance)
 {
+#if MINOTAR_HAVE_EXTENSIONS
+    const struct header_gnu_sparse* gnu = (const struct header_gnu_sparse*) instance->tarball_record_block;
+#endif
+    const char* block = (const char*) instance->tarball_record_block;
+
+    // two zero blocks in a row mark the end of the archive
+    if(minotar_is_zero(block, RECORD_BLOCK_ROUNDOFF)) {
+        instance->rx_byte_offset = 0;
+        if(++instance->zero_blocks == 2) {
+            instance->state = MINOTAR_STATE_trailer;
+            instance->archive_count++;
+            if(instance->archive_callback != NULL)
+                instance->archive_callback(instance->archive_context, instance->archive_count);
+        }
+        return true;
+    }
+
+    // GNU tar accepts a lone zero block, so do we
+    instance->zero_blocks = 0;
+
     // verify tarball header checksum.
-    if(!minotar_header_verify_checksum(instance)) {
+    if(!minotar_header_verify_checksum(block)) {
         instance->error = MINOTAR_invalid_checksum;
         return false;
     }
     
-    instance->record_header_complete = true;
-
+    if(instance->validate_only && !minotar_header_validate(instance))
+        return false;
+    
     // the instance->tarball_record_block doesnt count in the filesize so reset it
     instance->rx_byte_offset = 0;
-    
-    if(!minotar_create_file(instance)) {
-        instance->error = MINOTAR_failed_to_create_file;
+    instance->bytes_remaining = minotar_get_file_size(instance);
+    instance->padding_remaining = MINOTAR_CALC_PADDING(instance->bytes_remaining, RECORD_BLOCK_ROUNDOFF);
+
+    switch(instance->tarball_record_block->typeflag) {
+#if MINOTAR_HAVE_EXTENSIONS
+        case FILE_TYPE_pax_extended:
+            // the attributes apply to the entry that follows
+            instance->pax.field = 0;
+            instance->pax.record_remaining = 0;
+            instance->pax.number = 0;
+            instance->pax.key_length = 0;
+            instance->state = MINOTAR_STATE_pax_header;
+            if(instance->bytes_remaining == 0)
+                minotar_end_record(instance);
+            return true;
+        case FILE_TYPE_pax_global:
+            // global attributes are not supported.  They are not an entry either.
+            instance->state = MINOTAR_STATE_skip;
+            if(instance->bytes_remaining == 0)
+                minotar_end_record(instance);
+            return true;
+        case FILE_TYPE_gnu_sparse:
+            instance->sparse.active = true;
+            instance->sparse.realsize = minotar_parse_numeric(gnu->realsize, sizeof(gnu->realsize));
+            if(!minotar_sparse_parse_gnu(instance, gnu->sparse, sizeof(gnu->sparse) / sizeof(gnu->sparse[0])))
+                return false;
+
+            // the file is created now as the extension blocks replace the header buffer
+            if(!minotar_begin_entry(instance))
+                return false;
+
+            if(gnu->isextended)
+                instance->state = MINOTAR_STATE_sparse_header;
+            else if(instance->bytes_remaining == 0)
+                minotar_end_entry(instance);
+            return true;
+#else
+        case FILE_TYPE_pax_extended:
+        case FILE_TYPE_pax_global:
+            // ustar only.  The attributes are skipped and are not an entry.
+            instance->state = MINOTAR_STATE_skip;
+            if(instance->bytes_remaining == 0)
+                minotar_end_record(instance);
+            return true;
+        case FILE_TYPE_gnu_sparse:
+            // the stored data of a sparse file is not the file, better fail than corrupt it
+            instance->error = MINOTAR_header_invalid;
+            return false;
+#endif
+        default:
+            break;
+    }
+
+    if(!minotar_begin_entry(instance))
+        return false;
+
+    if(instance->bytes_remaining == 0 && instance->state == MINOTAR_STATE_payload)
+        minotar_end_entry(instance);
+
+    return true;
+}
+
+/**
+ * Create the file for the current header and get ready to write its data.
+ *
+ * @return This function returns whether the file was successfully created.
+ */
+static bool minotar_begin_entry(minotar_t* instance)
+{
+    // validation never touches the filesystem
+    if(!instance->validate_only && !minotar_create_file(instance)) {
+        if(instance->error == MINOTAR_noerror)
+            instance->error = MINOTAR_failed_to_create_file;
         return false;
     }
     
-    instance->bytes_remaining = minotar_get_file_size(instance);
+    instance->file_offset = 0;
+    instance->file_size = instance->bytes_remaining;
+    instance->punched_hole = false;
+    instance->state = MINOTAR_STATE_payload;
+
+#if MINOTAR_HAVE_EXTENSIONS
+    struct minotar_sparse_* sparse = &instance->sparse;
+    if(sparse->pax_1_0)
+        instance->state = MINOTAR_STATE_sparse_map;
+
+    if(sparse->active) {
+        // without an explicit size the file ends with its last data segment
+        if(sparse->realsize == 0 && sparse->count > 0)
+            sparse->realsize = sparse->map[sparse->count - 1].offset + sparse->map[sparse->count - 1].numbytes;
+
+        instance->file_size = sparse->realsize;
+        instance->punched_hole = true;
+    }
+#endif
     
     return true;
 }
 
 /**
- * Go through as many bytes as we can and write them out.  Any remaining bytes are returned
- * to the parent so the parsing may continue.
+ * Hand the finished file to the sink, or truncate and close it ourselves.
  * 
+ * @return This function returns false while the sink still holds the file open.
+ */
+static bool minotar_close_file(minotar_t* instance)
+{
+    minotar_write_flush(instance);
+    
+    if(instance->sink.finish != NULL) {
+        int result;
+        do {
+            result = instance->sink.finish(instance->sink.context, instance->fd, instance->file_size);
+        } while(result != 0 && errno == EINTR);
+        
+        if(result != 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            instance->blocked = true;
+            return false;
+        }
+        
+        if(result != 0)
+            instance->error = MINOTAR_failed_to_write;
+    }
+    else {
+        // extend the file over any trailing hole.  skipped ranges read back as zeros.
+        if(instance->punched_hole && ftruncate(instance->fd, (off_t) instance->file_size) != 0)
+            instance->error = MINOTAR_failed_to_write;
+
+        close(instance->fd);
+    }
+    
+    instance->fd = -1;
+    return true;
+}
+
+/**
+ * Close out the current entry and move on to its padding.
+ */
+static void minotar_end_entry(minotar_t* instance)
+{
+    if(instance->fd >= 0 && !minotar_close_file(instance)) {
+        // the sink is still busy with the file, try again on the next decode
+        instance->finish_pending = true;
+        return;
+    }
+    
+    instance->finish_pending = false;
+#if MINOTAR_HAVE_PROGRESS
+    instance->entries_completed++;
+#endif
+    
+    if(instance->payload_callback != NULL)
+        instance->payload_callback(instance->payload_context, NULL, 0);
+
+    minotar_pax_clear(instance);
+    minotar_sparse_clear(instance);
+    minotar_end_record(instance);
+}
+
+/**
+ * The payload of the current record is done, skip the padding and expect a header.
+ */
+static void minotar_end_record(minotar_t* instance)
+{
+    instance->rx_byte_offset = 0;
+    instance->state = instance->padding_remaining ? MINOTAR_STATE_padding : MINOTAR_STATE_header;
+}
+
+/**
+ * Hand bytes of the current file to the sink at the given offset.  A sink that
+ * cannot take more reports EAGAIN, which marks the instance as blocked.
+ *
+ * @return This function returns the number of bytes the sink accepted.
+ */
+static size_t minotar_write_at(minotar_t* instance, const char* bytes, size_t length, uint64_t offset)
+{
+    size_t accepted = 0;
+
+#if MINOTAR_WRITE_BUFFER_SIZE > 0
+    // files are written directly, so small runs are gathered into one large pwrite().
+    // A custom sink sees every run as it arrives so its backpressure still works.
+    if(instance->sink.write == NULL) {
+        if(instance->write_buffered > 0 &&
+           (offset != instance->write_buffer_offset + instance->write_buffered ||
+            length > MINOTAR_WRITE_BUFFER_SIZE - instance->write_buffered) &&
+           !minotar_write_flush(instance))
+            return 0;
+
+        if(length < MINOTAR_WRITE_BUFFER_SIZE) {
+            if(instance->write_buffered == 0)
+                instance->write_buffer_offset = offset;
+            memcpy(&instance->write_buffer[instance->write_buffered], bytes, length);
+            instance->write_buffered += length;
+            return length;
+        }
+    }
+#endif
+
+    while(accepted < length) {
+        ssize_t written = 0;
+        if(instance->sink.write != NULL)
+            written = instance->sink.write(instance->sink.context, instance->fd, offset + accepted,
+                                           &bytes[accepted], length - accepted);
+        else
+            written = pwrite(instance->fd, &bytes[accepted], length - accepted, (off_t) (offset + accepted));
+
+        if(written < 0 && errno == EINTR)
+            continue;
+
+        if(written == 0 || (written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))) {
+            instance->blocked = true;
+            break;
+        }
+
+        if(written < 0) {
+            instance->error = MINOTAR_failed_to_write;
+            break;
+        }
+
+        accepted += written;
+    }
+
+    return accepted;
+}
+
+/**
+ * Write out any file data gathered for one large write.
+ *
+ * @return This function returns false when the write failed.
+ */
+static bool minotar_write_flush(minotar_t* instance)
+{
+#if MINOTAR_WRITE_BUFFER_SIZE > 0
+    size_t written = 0;
+
+    while(written < instance->write_buffered) {
+        ssize_t result = pwrite(instance->fd, &instance->write_buffer[written], instance->write_buffered - written,
+                                (off_t) (instance->write_buffer_offset + written));
+        if(result < 0 && errno == EINTR)
+            continue;
+
+        if(result <= 0) {
+            instance->error = MINOTAR_failed_to_write;
+            break;
+        }
+
+        written += result;
+    }
+
+    instance->write_buffered = 0;
+    return instance->error == MINOTAR_noerror;
+#else
+    (void) instance;
+    return true;
+#endif
+}
+
+/**
+ * Write file data, leaving holes where a sparse map or zero detection allows it.
+ *
+ * @return This function returns the number of bytes the sink accepted.
+ */
+static size_t minotar_write(minotar_t* instance, const char* bytes, size_t length)
+{
+    size_t accepted = 0;
+
+#if MINOTAR_HAVE_EXTENSIONS
+    struct minotar_sparse_* sparse = &instance->sparse;
+
+    // the stored data is every segment of the sparse map back to back
+    if(sparse->active) {
+        while(accepted < length) {
+            while(sparse->index < sparse->count && sparse->segment_written == sparse->map[sparse->index].numbytes) {
+                sparse->index++;
+                sparse->segment_written = 0;
+            }
+
+            // more data than the map accounts for
+            if(sparse->index >= sparse->count) {
+                instance->error = MINOTAR_header_invalid;
+                break;
+            }
+
+            const struct minotar_sparse_segment_* segment = &sparse->map[sparse->index];
+            size_t write_size = MINOTAR_MIN(length - accepted, segment->numbytes - sparse->segment_written);
+            size_t written = minotar_write_at(instance, &bytes[accepted], write_size,
+                                              segment->offset + sparse->segment_written);
+
+            sparse->segment_written += written;
+            accepted += written;
+            if(written < write_size)
+                break;
+        }
+        return accepted;
+    }
+
+    if(instance->sparse_detection) {
+        // walk the data a block at a time and coalesce everything between zero runs into one write
+        size_t span_start = 0;
+        size_t idx = 0;
+        while(idx < length) {
+            size_t run = MINOTAR_MIN(length - idx,
+                RECORD_BLOCK_ROUNDOFF - ((instance->file_offset + idx) & (RECORD_BLOCK_ROUNDOFF - 1)));
+
+            if(minotar_is_zero(&bytes[idx], run)) {
+                if(idx > span_start) {
+                    size_t written = minotar_write_at(instance, &bytes[span_start], idx - span_start,
+                                                      instance->file_offset + span_start);
+                    if(written < idx - span_start) {
+                        instance->file_offset += span_start + written;
+                        return span_start + written;
+                    }
+                }
+
+                span_start = idx + run;
+                instance->punched_hole = true;
+            }
+            idx += run;
+        }
+
+        accepted = length;
+        if(length > span_start) {
+            size_t written = minotar_write_at(instance, &bytes[span_start], length - span_start,
+                                              instance->file_offset + span_start);
+            accepted = span_start + written;
+        }
+
+        instance->file_offset += accepted;
+        return accepted;
+    }
+#endif
+
+    accepted = minotar_write_at(instance, bytes, length, instance->file_offset);
+    instance->file_offset += accepted;
+    return accepted;
+}
+
+/**
+ * A record that runs past the end of the input can only be truncated.
+ *
+ * @param header_size   The bytes of the header parsed since stream_offset was updated.
+ */
+static void minotar_check_record_end(minotar_t* instance, size_t header_size)
+{
+    uint64_t record_end = instance->stream_offset + header_size +
+                          instance->bytes_remaining + instance->padding_remaining;
+    if(instance->input_length != 0 && record_end > instance->input_length &&
+       instance->error == MINOTAR_noerror)
+        instance->error = MINOTAR_truncated_archive;
+}
+
+/**
+ * Collect a 512 byte header block and parse it once it is complete.
+ *
  * @return This function returns the number of bytes parsed.
  */
-static size_t minotar_parse(minotar_t* instance, const char* bytes, size_t length)
+static size_t minotar_parse_header(minotar_t* instance, const char* bytes, size_t length)
+{
+    size_t header_write_size = MINOTAR_MIN(RECORD_BLOCK_ROUNDOFF - instance->rx_byte_offset, length);
+
+    // copy as much as we can to the instance header buffer
+    memcpy(&instance->record_header_buf[instance->rx_byte_offset], bytes, header_write_size);
+    instance->rx_byte_offset += header_write_size;
+
+    if(instance->rx_byte_offset == RECORD_BLOCK_ROUNDOFF) {
+#if MINOTAR_HAVE_EXTENSIONS
+        if(instance->state == MINOTAR_STATE_sparse_header)
+            minotar_parse_sparse_extension(instance);
+        else
+#endif
+            minotar_parse_record_block(instance);
+
+        minotar_check_record_end(instance, header_write_size);
+    }
+
+    return header_write_size;
+}
+
+/**
+ * Parse a header that lies whole in the input where it is, then carry on through
+ * the data and padding of its record as far as the input goes.  The header is only
+ * copied to the instance when its record is still open at the end of the input.
+ *
+ * @param length    The bytes available, at least one header block.
+ * @return This function returns the number of bytes parsed.
+ */
+static size_t minotar_parse_header_in_place(minotar_t* instance, const char* bytes, size_t length)
+{
+    size_t parsed = RECORD_BLOCK_ROUNDOFF;
+
+    instance->tarball_record_block = (const struct header_posix_ustar*) bytes;
+    minotar_parse_record_block(instance);
+    minotar_check_record_end(instance, RECORD_BLOCK_ROUNDOFF);
+
+    if(instance->error == MINOTAR_noerror && instance->state == MINOTAR_STATE_payload)
+        parsed += minotar_parse_payload(instance, &bytes[parsed], length - parsed);
+
+    if(instance->error == MINOTAR_noerror && instance->state == MINOTAR_STATE_padding && parsed < length)
+        parsed += minotar_parse(instance, &bytes[parsed], length - parsed);
+
+    // the input is the callers once we return, keep what later decodes still read
+    if(instance->state == MINOTAR_STATE_payload
+#if MINOTAR_HAVE_EXTENSIONS
+       || instance->state == MINOTAR_STATE_sparse_map
+#endif
+       )
+        memcpy(instance->record_header_buf, bytes, RECORD_BLOCK_ROUNDOFF);
+    instance->tarball_record_block = (const struct header_posix_ustar*) instance->record_header_buf;
+
+    return parsed;
+}
+
+#if MINOTAR_HAVE_EXTENSIONS
+/**
+ * Look up a PAX keyword.
+ *
+ * @return This function returns the keyword id, or unknown for keywords we ignore.
+ */
+static minotar_pax_key_t minotar_pax_lookup(const char* key, size_t length)
+{
+    static const struct {
+        const char*         name;
+        minotar_pax_key_t   id;
+    } keys[] = {
+        { "path",                   MINOTAR_PAX_KEY_path },
+        { "GNU.sparse.name",        MINOTAR_PAX_KEY_sparse_name },
+        { "GNU.sparse.size",        MINOTAR_PAX_KEY_sparse_size },
+        { "GNU.sparse.realsize",    MINOTAR_PAX_KEY_sparse_realsize },
+        { "GNU.sparse.major",       MINOTAR_PAX_KEY_sparse_major },
+        { "GNU.sparse.minor",       MINOTAR_PAX_KEY_sparse_minor },
+        { "GNU.sparse.numblocks",   MINOTAR_PAX_KEY_sparse_numblocks },
+        { "GNU.sparse.offset",      MINOTAR_PAX_KEY_sparse_offset },
+        { "GNU.sparse.numbytes",    MINOTAR_PAX_KEY_sparse_numbytes },
+        { "GNU.sparse.map",         MINOTAR_PAX_KEY_sparse_map },
+    };
+
+    for(size_t idx = 0; idx < sizeof(keys) / sizeof(keys[0]); ++idx) {
+        if(strlen(keys[idx].name) == length && !memcmp(keys[idx].name, key, length))
+            return keys[idx].id;
+    }
+
+    return MINOTAR_PAX_KEY_unknown;
+}
+
+/**
+ * Append a byte to the PAX path override.
+ *
+ * @return This function returns false when the path could not grow.
+ */
+static bool minotar_pax_path_append(minotar_t* instance, char c)
+{
+    struct minotar_pax_* pax = &instance->pax;
+
+    // a hostile archive could otherwise make us allocate whatever its size field claims
+    if(pax->path_length + 1 >= MINOTAR_PAX_PATH_MAX) {
+        instance->error = MINOTAR_header_invalid;
+        return false;
+    }
+
+    // keep room for the null byte
+    if(pax->path_length + 1 >= pax->path_capacity) {
+        size_t capacity = pax->path_capacity ? pax->path_capacity * 2 : 128;
+        char* path = realloc(pax->path, capacity);
+        if(path == NULL) {
+            instance->error = MINOTAR_out_of_memory;
+            return false;
+        }
+        pax->path = path;
+        pax->path_capacity = capacity;
+    }
+
+    pax->path[pax->path_length++] = c;
+    pax->path[pax->path_length] = '\0';
+    return true;
+}
+
+/**
+ * A PAX record is complete, act on its value.
+ */
+static void minotar_pax_commit(minotar_t* instance)
+{
+    struct minotar_pax_* pax = &instance->pax;
+
+    switch(pax->key_id) {
+        case MINOTAR_PAX_KEY_sparse_size:
+        case MINOTAR_PAX_KEY_sparse_realsize:
+            instance->sparse.active = true;
+            instance->sparse.realsize = pax->number;
+            break;
+        case MINOTAR_PAX_KEY_sparse_major:
+            // version 1.0 keeps the map at the front of the file data
+            instance->sparse.active = true;
+            instance->sparse.pax_1_0 = (pax->number == 1);
+            break;
+        case MINOTAR_PAX_KEY_sparse_offset:
+        case MINOTAR_PAX_KEY_sparse_numbytes:
+            minotar_sparse_push(instance, pax->number);
+            break;
+        case MINOTAR_PAX_KEY_sparse_map:
+            // the last number of the map has no trailing ','
+            if(pax->key_length > 0)
+                minotar_sparse_push(instance, pax->number);
+            break;
+        default:
+            break;
+    }
+}
+
+/**
+ * Parse as much of a PAX extended header as we have.  Each record is
+ * "<length> <key>=<value>\n" where length counts the whole record.
+ *
+ * @return This function returns the number of bytes parsed.
+ */
+static size_t minotar_parse_pax_header(minotar_t* instance, const char* bytes, size_t length)
 {
+    struct minotar_pax_* pax = &instance->pax;
+    size_t parse_size = MINOTAR_MIN(length, instance->bytes_remaining);
     size_t offset = 0;
-    
-    // Check to see if we have gotten the whole record block header
-    if(!instance->record_header_complete) {
-        ssize_t header_write_size = MINOTAR_MIN(RECORD_BLOCK_ROUNDOFF - instance->rx_byte_offset, length);
-        if(header_write_size) {
-            // copy as much as we can to the instance header buffer
-            memcpy(&instance->record_header_buf[instance->rx_byte_offset], &bytes[offset], header_write_size);
 
-            instance->rx_byte_offset += header_write_size;
-            offset += header_write_size;
+    for(; offset < parse_size && instance->error == MINOTAR_noerror; ++offset) {
+        char c = bytes[offset];
 
-            if(instance->rx_byte_offset == RECORD_BLOCK_ROUNDOFF) {
-                minotar_parse_record_block(instance);
+        if(pax->field == 0) {
+            // record length, key_length counts its digits
+            if(c >= '0' && c <= '9') {
+                pax->number = pax->number * 10 + (uint64_t) (c - '0');
+                pax->key_length++;
+            }
+            else if(c == ' ' && pax->number > pax->key_length + 1) {
+                pax->record_remaining = pax->number - (pax->key_length + 1);
+                pax->number = 0;
+                pax->key_length = 0;
+                pax->field = 1;
             }
+            else {
+                instance->error = MINOTAR_header_invalid;
+            }
+            continue;
+        }
+
+        if(--pax->record_remaining == 0) {
+            // every record ends with a newline
+            if(pax->field != 2 || c != '\n') {
+                instance->error = MINOTAR_header_invalid;
+                continue;
+            }
+            minotar_pax_commit(instance);
+            pax->field = 0;
+            pax->number = 0;
+            pax->key_length = 0;
+            continue;
+        }
+
+        if(pax->field == 1) {
+            if(c != '=') {
+                if(pax->key_length < sizeof(pax->key))
+                    pax->key[pax->key_length] = c;
+                pax->key_length++;
+                continue;
+            }
+
+            pax->key_id = MINOTAR_PAX_KEY_unknown;
+            if(pax->key_length <= sizeof(pax->key))
+                pax->key_id = minotar_pax_lookup(pax->key, pax->key_length);
+
+            // GNU.sparse.name holds the real name of a sparse file, path would be a dummy
+            if(pax->key_id == MINOTAR_PAX_KEY_path && pax->path_from_sparse)
+                pax->key_id = MINOTAR_PAX_KEY_unknown;
+            if(pax->key_id == MINOTAR_PAX_KEY_path || pax->key_id == MINOTAR_PAX_KEY_sparse_name) {
+                pax->path_length = 0;
+                pax->path_from_sparse = (pax->key_id == MINOTAR_PAX_KEY_sparse_name);
+            }
+
+            pax->key_length = 0;
+            pax->field = 2;
+            continue;
+        }
+
+        // value, key_length counts its bytes
+        pax->key_length++;
+        switch(pax->key_id) {
+            case MINOTAR_PAX_KEY_path:
+            case MINOTAR_PAX_KEY_sparse_name:
+                minotar_pax_path_append(instance, c);
+                break;
+            case MINOTAR_PAX_KEY_sparse_map:
+                if(c == ',') {
+                    minotar_sparse_push(instance, pax->number);
+                    pax->number = 0;
+                    break;
+                }
+                // fall through
+            default:
+                if(c >= '0' && c <= '9')
+                    pax->number = pax->number * 10 + (uint64_t) (c - '0');
+                break;
         }
     }
-    
-    // write the next set of bytes to current file
-    ssize_t write_size = MINOTAR_MIN(length - offset, instance->bytes_remaining);
-    if(write_size > 0) {
-        if(instance->file != NULL)
-            fwrite(&bytes[offset], sizeof(char), write_size, instance->file);
 
-        // increment our position
-        offset += write_size;
-        instance->rx_byte_offset += write_size;
-        instance->bytes_remaining -= write_size;
+    instance->bytes_remaining -= offset;
+    if(instance->bytes_remaining == 0 && instance->error == MINOTAR_noerror)
+        minotar_end_record(instance);
+
+    return offset;
+}
+
+/**
+ * Parse the PAX 1.0 sparse map.  It is a line with the number of segments followed
+ * by a line per offset and length, padded to a whole block ahead of the file data.
+ *
+ * @return This function returns the number of bytes parsed.
+ */
+static size_t minotar_parse_sparse_map(minotar_t* instance, const char* bytes, size_t length)
+{
+    struct minotar_sparse_* sparse = &instance->sparse;
+    size_t parse_size = MINOTAR_MIN(length, instance->bytes_remaining);
+    size_t offset = 0;
+
+    while(!sparse->map_done && offset < parse_size && instance->error == MINOTAR_noerror) {
+        char c = bytes[offset++];
+
+        if(c >= '0' && c <= '9') {
+            sparse->number = sparse->number * 10 + (uint64_t) (c - '0');
+            sparse->have_number = true;
+            continue;
+        }
+
+        if(c != '\n' || !sparse->have_number) {
+            instance->error = MINOTAR_header_invalid;
+            break;
+        }
+
+        if(!sparse->map_counted) {
+            sparse->map_entries = sparse->number * 2;
+            sparse->map_counted = true;
+            // the map is rebuilt from the file data
+            sparse->count = 0;
+            sparse->half = false;
+        }
+        else {
+            minotar_sparse_push(instance, sparse->number);
+            sparse->map_entries--;
+        }
+
+        sparse->number = 0;
+        sparse->have_number = false;
+        sparse->map_done = (sparse->map_entries == 0);
     }
 
-    // If we have completed writing the file and we still have bytes, add up to 511 bytes for padding
-    if(instance->record_header_complete && instance->bytes_remaining == 0) {
-        // calculate how many bytes we need to pad to 512 bytes
-        size_t padding_remaining = MINOTAR_CALC_PADDING(instance->rx_byte_offset, RECORD_BLOCK_ROUNDOFF);
-        size_t padding_size = MINOTAR_MIN(padding_remaining, length - offset);
-        
-        instance->rx_byte_offset += padding_size;
+    sparse->map_bytes += offset;
+
+    // skip the padding between the map and the data
+    if(sparse->map_done) {
+        size_t padding_size = MINOTAR_MIN(parse_size - offset,
+            MINOTAR_CALC_PADDING(sparse->map_bytes, RECORD_BLOCK_ROUNDOFF));
         offset += padding_size;
-        
-        if((instance->rx_byte_offset & 512) == 0)
-        minotar_reset(instance);
+        sparse->map_bytes += padding_size;
+
+        if(MINOTAR_CALC_PADDING(sparse->map_bytes, RECORD_BLOCK_ROUNDOFF) == 0)
+            instance->state = MINOTAR_STATE_payload;
+    }
+
+    instance->bytes_remaining -= offset;
+    if(instance->bytes_remaining == 0 && instance->error == MINOTAR_noerror) {
+        if(instance->state != MINOTAR_STATE_payload)
+            instance->error = MINOTAR_header_invalid;
+        else
+            minotar_end_entry(instance);
     }
+
+    return offset;
+}
+
+#endif // MINOTAR_HAVE_EXTENSIONS
+
+/**
+ * Write as much of the current file as we have.
+ *
+ * @return This function returns the number of bytes parsed.
+ */
+static size_t minotar_parse_payload(minotar_t* instance, const char* bytes, size_t length)
+{
+    size_t write_size = MINOTAR_MIN(length, instance->bytes_remaining);
+
+    // the sink may take less than we offer when it applies backpressure
+    if(instance->fd >= 0)
+        write_size = minotar_write(instance, bytes, write_size);
     
+    if(instance->payload_callback != NULL && write_size > 0)
+        instance->payload_callback(instance->payload_context, bytes, write_size);
+
+    instance->bytes_remaining -= write_size;
+    if(instance->bytes_remaining == 0)
+        minotar_end_entry(instance);
+
+    return write_size;
+}
+
+/**
+ * Skip what follows the end of archive marker.  That is normally zero padding up to
+ * the blocking factor of the writer.  In a concatenated stream the first block that
+ * does not start with a zero byte is the header of the next archive.
+ *
+ * @return This function returns the number of bytes parsed.
+ */
+static size_t minotar_parse_trailer(minotar_t* instance, const char* bytes, size_t length)
+{
+    size_t offset = 0;
+
+    // a single archive ignores everything after its end marker
+    if(!instance->concatenated)
+        return length;
+
+    // only the first byte of each block needs to be looked at
+    while(offset < length) {
+        if(instance->rx_byte_offset == 0 && bytes[offset] != '\0') {
+            instance->zero_blocks = 0;
+            instance->state = MINOTAR_STATE_header;
+            break;
+        }
+
+        size_t skip_size = MINOTAR_MIN(length - offset, RECORD_BLOCK_ROUNDOFF - instance->rx_byte_offset);
+        offset += skip_size;
+        instance->rx_byte_offset = (instance->rx_byte_offset + skip_size) & (RECORD_BLOCK_ROUNDOFF - 1);
+    }
+
     return offset;
 }
+
+#if MINOTAR_HAVE_PROGRESS
+/**
+ * Add a timed decode to the throughput and report progress when it is due.  The end
+ * of an archive is always reported.
+ *
+ * @param start_ns  When the decode started, or 0 if it was not timed.
+ * @param bytes     The bytes that decode consumed.
+ */
+static void minotar_progress_sample(minotar_t* instance, uint64_t start_ns, size_t bytes)
+{
+    uint64_t now = minotar_now_ns();
+    bool force = instance->archive_count != instance->progress_archives;
+    
+    if(start_ns != 0) {
+        instance->sample_offset = instance->stream_offset;
+        instance->sample_bytes += bytes;
+        instance->sample_ns += now - start_ns;
+        
+        // short decodes are added up so clock overhead does not skew the rate
+        if(instance->sample_bytes >= MINOTAR_CHUNK_MIN && instance->sample_ns > 0) {
+            uint64_t rate = instance->sample_bytes * 1000000000u / instance->sample_ns;
+            instance->throughput = instance->throughput ? (3 * instance->throughput + rate) / 4 : rate;
+            instance->sample_bytes = 0;
+            instance->sample_ns = 0;
+        }
+    }
+    
+    // the first report is one interval after the first decode
+    if(instance->progress_last_ns == 0)
+        instance->progress_last_ns = now;
+    
+    instance->progress_archives = instance->archive_count;
+    
+    if(instance->progress_callback == NULL || (!force && now - instance->progress_last_ns < instance->progress_interval_ns))
+        return;
+    
+    minotar_progress_t progress;
+    minotar_get_progress(instance, &progress);
+    instance->progress_last_ns = now;
+    instance->progress_callback(instance->progress_context, &progress);
+}
+#endif
+
+/**
+ * Go through as many bytes as we can and write them out.  Any remaining bytes are returned
+ * to the parent so the parsing may continue.
+ * 
+ * @return This function returns the number of bytes parsed.
+ */
+static size_t minotar_parse(minotar_t* instance, const char* bytes, size_t length)
+{
+    size_t padding_size = 0;
+    size_t skip_size = 0;
+    
+    switch(instance->state) {
+        case MINOTAR_STATE_header:
+            return minotar_parse_header(instance, bytes, length);
+#if MINOTAR_HAVE_EXTENSIONS
+        case MINOTAR_STATE_sparse_header:
+            return minotar_parse_header(instance, bytes, length);
+        case MINOTAR_STATE_pax_header:
+            return minotar_parse_pax_header(instance, bytes, length);
+        case MINOTAR_STATE_sparse_map:
+            return minotar_parse_sparse_map(instance, bytes, length);
+#endif
+        case MINOTAR_STATE_payload:
+            return minotar_parse_payload(instance, bytes, length);
+        case MINOTAR_STATE_trailer:
+            return minotar_parse_trailer(instance, bytes, length);
+        case MINOTAR_STATE_skip:
+            // metadata this build does not use, it never reaches the payload callback
+            skip_size = MINOTAR_MIN(instance->bytes_remaining, length);
+            instance->bytes_remaining -= skip_size;
+            if(instance->bytes_remaining == 0)
+                minotar_end_record(instance);
+            return skip_size;
+        case MINOTAR_STATE_padding:
+            // Tar headers and data are padded up to 511 bytes to the next block
+            padding_size = MINOTAR_MIN(instance->padding_remaining, length);
+            if(instance->validate_only && !minotar_is_zero(bytes, padding_size))
+                instance->error = MINOTAR_invalid_padding;
+            instance->padding_remaining -= padding_size;
+            if(instance->padding_remaining == 0)
+                instance->state = MINOTAR_STATE_header;
+            return padding_size;
+    }
+    
+    instance->error = MINOTAR_unknown_error;
+    return 0;
+}
@@ -0,0 +1,749 @@
+/**
+ * Copyright (c) 2017 Michael Skeffington
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3 of the License, or (at your option) any later version.
+ * See the file COPYING included with this distribution for more
+ * information.
+ */
+
+// fseeko() is POSIX, not C11
+#define _XOPEN_SOURCE 700
+
+#include "minotar_gzindex.h"
+#include "minotar_internal.h"
+#include <zlib.h>
+#include <string.h>
+#include <stdlib.h>
+
+// deflate looks back at most 32 KiB
+#define MINOTAR_GZINDEX_WINDOW          (32768)
+#define MINOTAR_GZINDEX_CHUNK           (16384)
+#define MINOTAR_GZINDEX_DEFAULT_SPAN    (1024 * 1024)
+// most of an extended header kept to look for the member name
+#define MINOTAR_GZINDEX_EXTENDED_MAX    (64 * 1024)
+
+// index file signature, bump the digit when the layout changes
+static const char minotar_gzindex_magic[8] = { 'M', 'T', 'G', 'Z', 'I', 'D', 'X', '1' };
+
+
+// ---------------- INTERNAL STRUCTURES -----------------------
+
+/**
+ * Deflate state at a block boundary.  Inflation can restart here given the last
+ * 32 KiB of output and the bits of the byte the block starts in.
+ */
+struct minotar_gzindex_point_ {
+    uint64_t        out;        // uncompressed offset
+    uint64_t        in;         // compressed offset of the first whole byte
+    int             bits;       // bits of the byte before that belonging to the block
+    unsigned char   window[MINOTAR_GZINDEX_WINDOW];
+};
+
+/**
+ * A tar member.  The offset is its first header, PAX and GNU extension headers
+ * included, so extracting from there keeps the extended attributes.
+ */
+struct minotar_gzindex_member_ {
+    uint64_t    offset;
+    uint64_t    end;        // end of the data, padding included
+    char*       name;
+};
+
+struct minotar_gzindex_ {
+    struct minotar_gzindex_point_*  points;
+    size_t                          point_count;
+    size_t                          point_capacity;
+    struct minotar_gzindex_member_* members;
+    size_t                          member_count;
+    size_t                          member_capacity;
+};
+
+/**
+ * Follows the tar headers in the uncompressed output while the index is built.
+ */
+struct minotar_gzindex_walker_ {
+    uint64_t    next_header;        // uncompressed offset of the next header block
+    uint64_t    member_offset;      // first header of the member being walked
+    uint64_t    sparse_size;        // payload of an 'S' entry behind its extension blocks
+    size_t      fill;
+    bool        in_member;
+    bool        sparse_extension;
+    bool        done;
+    char        block[RECORD_BLOCK_ROUNDOFF];
+    char        name[155 + 1 + 100 + 1];    // prefix '/' name
+    char*       long_name;          // name from a PAX header, or NULL
+    char*       extended;           // records of the PAX header being read
+    size_t      extended_length;
+    uint64_t    extended_remaining; // bytes of the extended header still to come
+};
+
+
+// ---------------- FORWARD DECLARATIONS ----------------------
+
+static bool minotar_gzindex_add_point(minotar_gzindex_t* index, int bits, uint64_t in, uint64_t out,
+                                      unsigned left, const unsigned char* window);
+static bool minotar_gzindex_add_member(minotar_gzindex_t* index, const struct minotar_gzindex_walker_* walker);
+static bool minotar_gzindex_walk_extended(struct minotar_gzindex_walker_* walker);
+static bool minotar_gzindex_walk(minotar_gzindex_t* index, struct minotar_gzindex_walker_* walker,
+                                 const unsigned char* bytes, size_t length, uint64_t position);
+
+
+// ------------------ INLINE FUNCTIONS ------------------------
+
+/**
+ * Index files are little endian whatever the host is.
+ *
+ * @return This function returns false if the write failed.
+ */
+static inline bool minotar_gzindex_put(FILE* out, uint64_t value)
+{
+    unsigned char bytes[8];
+
+    for(size_t idx = 0; idx < sizeof(bytes); ++idx)
+        bytes[idx] = (unsigned char) (value >> (8 * idx));
+
+    return fwrite(bytes, sizeof(bytes), 1, out) == 1;
+}
+
+/**
+ * @return This function returns false if the read failed.
+ */
+static inline bool minotar_gzindex_get(FILE* in, uint64_t* value)
+{
+    unsigned char bytes[8];
+
+    if(fread(bytes, sizeof(bytes), 1, in) != 1)
+        return false;
+
+    *value = 0;
+    for(size_t idx = 0; idx < sizeof(bytes); ++idx)
+        *value |= (uint64_t) bytes[idx] << (8 * idx);
+
+    return true;
+}
+
+
+// ------------------ PUBLIC FUNCTIONS ------------------------
+
+/**
+ * Inflate a .tar.gz archive once and build its index.
+ *
+ * @param archive   The archive, opened for reading.
+ * @param span      Uncompressed bytes between checkpoints, 0 for 1 MiB.
+ * @return an error code as defined in the error struct.
+ */
+minotar_error_t minotar_gzindex_build(minotar_gzindex_t** p_index, FILE* archive, uint64_t span)
+{
+    minotar_error_t error = MINOTAR_noerror;
+    struct minotar_gzindex_walker_ walker = {0};
+    z_stream strm = {0};
+    unsigned char* input = NULL;
+    unsigned char* window = NULL;
+    uint64_t totin = 0;
+    uint64_t totout = 0;
+    uint64_t last = 0;
+    int ret = Z_OK;
+
+    if(p_index == NULL || archive == NULL)
+        return MINOTAR_invalid_parameter;
+
+    if(span == 0)
+        span = MINOTAR_GZINDEX_DEFAULT_SPAN;
+
+    *p_index = calloc(1, sizeof(**p_index));
+    input = malloc(MINOTAR_GZINDEX_CHUNK);
+    // the first checkpoint is taken before inflate fills the window
+    window = calloc(1, MINOTAR_GZINDEX_WINDOW);
+    if(*p_index == NULL || input == NULL || window == NULL) {
+        error = MINOTAR_out_of_memory;
+        goto exit;
+    }
+
+    // 47 tells zlib to detect the gzip header on its own
+    if(inflateInit2(&strm, 47) != Z_OK) {
+        error = MINOTAR_out_of_memory;
+        goto exit;
+    }
+
+    do {
+        strm.avail_in = fread(input, 1, MINOTAR_GZINDEX_CHUNK, archive);
+        if(strm.avail_in == 0) {
+            error = ferror(archive) ? MINOTAR_unknown_error : MINOTAR_truncated_archive;
+            break;
+        }
+        strm.next_in = input;
+
+        // inflate a deflate block at a time so every block boundary can be a checkpoint
+        do {
+            if(strm.avail_out == 0) {
+                strm.avail_out = MINOTAR_GZINDEX_WINDOW;
+                strm.next_out = window;
+            }
+
+            unsigned char* output = strm.next_out;
+            totin += strm.avail_in;
+            totout += strm.avail_out;
+            ret = inflate(&strm, Z_BLOCK);
+            totin -= strm.avail_in;
+            totout -= strm.avail_out;
+
+            if(ret == Z_NEED_DICT || ret == Z_DATA_ERROR || ret == Z_MEM_ERROR) {
+                error = (ret == Z_MEM_ERROR) ? MINOTAR_out_of_memory : MINOTAR_decompress_failed;
+                break;
+            }
+
+            size_t produced = (size_t) (strm.next_out - output);
+            if(!minotar_gzindex_walk(*p_index, &walker, output, produced, totout - produced)) {
+                error = MINOTAR_out_of_memory;
+                break;
+            }
+
+            if(ret == Z_STREAM_END)
+                break;
+
+            // at the end of a block that is not the last one
+            if((strm.data_type & 128) && !(strm.data_type & 64) && (totout == 0 || totout - last > span)) {
+                if(!minotar_gzindex_add_point(*p_index, strm.data_type & 7, totin, totout, strm.avail_out, window)) {
+                    error = MINOTAR_out_of_memory;
+                    break;
+                }
+                last = totout;
+            }
+        } while(strm.avail_in != 0);
+    } while(error == MINOTAR_noerror && ret != Z_STREAM_END);
+
+    inflateEnd(&strm);
+
+exit:
+    free(input);
+    free(window);
+    free(walker.extended);
+    free(walker.long_name);
+
+    if(error != MINOTAR_noerror)
+        minotar_gzindex_deinit(p_index);
+
+    return error;
+}
+
+/**
+ * Free an index.
+ *
+ * @return an error code as defined in the error struct.
+ */
+minotar_error_t minotar_gzindex_deinit(minotar_gzindex_t** p_index)
+{
+    if(p_index == NULL || *p_index == NULL)
+        return MINOTAR_invalid_parameter;
+
+    for(size_t idx = 0; idx < (*p_index)->member_count; ++idx)
+        free((*p_index)->members[idx].name);
+
+    free((*p_index)->members);
+    free((*p_index)->points);
+    free(*p_index);
+    *p_index = NULL;
+
+    return MINOTAR_noerror;
+}
+
+/**
+ * Write an index to a file.
+ *
+ * @param out   A file opened for writing.
+ * @return an error code as defined in the error struct.
+ */
+minotar_error_t minotar_gzindex_save(const minotar_gzindex_t* index, FILE* out)
+{
+    bool result = true;
+
+    if(index == NULL || out == NULL)
+        return MINOTAR_invalid_parameter;
+
+    result = fwrite(minotar_gzindex_magic, sizeof(minotar_gzindex_magic), 1, out) == 1 &&
+             minotar_gzindex_put(out, index->point_count) &&
+             minotar_gzindex_put(out, index->member_count);
+
+    for(size_t idx = 0; result && idx < index->point_count; ++idx) {
+        const struct minotar_gzindex_point_* point = &index->points[idx];
+        result = minotar_gzindex_put(out, point->out) &&
+                 minotar_gzindex_put(out, point->in) &&
+                 minotar_gzindex_put(out, (uint64_t) point->bits) &&
+                 fwrite(point->window, sizeof(point->window), 1, out) == 1;
+    }
+
+    for(size_t idx = 0; result && idx < index->member_count; ++idx) {
+        const struct minotar_gzindex_member_* member = &index->members[idx];
+        size_t name_length = strlen(member->name);
+        result = minotar_gzindex_put(out, member->offset) &&
+                 minotar_gzindex_put(out, member->end) &&
+                 minotar_gzindex_put(out, name_length) &&
+                 fwrite(member->name, 1, name_length, out) == name_length;
+    }
+
+    return result ? MINOTAR_noerror : MINOTAR_failed_to_write;
+}
+
+/**
+ * Read an index written by minotar_gzindex_save().
+ *
+ * @param in    A file opened for reading.
+ * @return an error code as defined in the error struct.
+ */
+minotar_error_t minotar_gzindex_load(minotar_gzindex_t** p_index, FILE* in)
+{
+    minotar_gzindex_t* index = NULL;
+    char magic[sizeof(minotar_gzindex_magic)];
+    uint64_t point_count = 0;
+    uint64_t member_count = 0;
+    bool result = true;
+
+    if(p_index == NULL || in == NULL)
+        return MINOTAR_invalid_parameter;
+
+    if(fread(magic, sizeof(magic), 1, in) != 1 || memcmp(magic, minotar_gzindex_magic, sizeof(magic)) ||
+       !minotar_gzindex_get(in, &point_count) || !minotar_gzindex_get(in, &member_count))
+        return MINOTAR_header_invalid;
+
+    index = calloc(1, sizeof(*index));
+    if(index == NULL)
+        return MINOTAR_out_of_memory;
+
+    // the counts come from the file, grow as the records actually arrive
+    for(uint64_t idx = 0; result && idx < point_count; ++idx) {
+        struct minotar_gzindex_point_ point;
+        uint64_t bits = 0;
+        result = minotar_gzindex_get(in, &point.out) &&
+                 minotar_gzindex_get(in, &point.in) &&
+                 minotar_gzindex_get(in, &bits) && bits < 8 &&
+                 fread(point.window, sizeof(point.window), 1, in) == 1 &&
+                 minotar_gzindex_add_point(index, (int) bits, point.in, point.out, 0, point.window);
+    }
+
+    for(uint64_t idx = 0; result && idx < member_count; ++idx) {
+        struct minotar_gzindex_walker_ walker = {0};
+        uint64_t name_length = 0;
+        result = minotar_gzindex_get(in, &walker.member_offset) &&
+                 minotar_gzindex_get(in, &walker.next_header) &&
+                 minotar_gzindex_get(in, &name_length) && name_length < sizeof(walker.name) &&
+                 fread(walker.name, 1, name_length, in) == name_length &&
+                 minotar_gzindex_add_member(index, &walker);
+    }
+
+    if(!result) {
+        minotar_gzindex_deinit(&index);
+        return MINOTAR_header_invalid;
+    }
+
+    *p_index = index;
+    return MINOTAR_noerror;
+}
+
+/**
+ * @return the number of tar members in the index.
+ */
+size_t minotar_gzindex_get_member_count(const minotar_gzindex_t* index)
+{
+    return (index != NULL) ? index->member_count : 0;
+}
+
+/**
+ * @return the name of a tar member as stored in its header, or NULL.
+ */
+const char* minotar_gzindex_get_member_name(const minotar_gzindex_t* index, size_t member)
+{
+    if(index == NULL || member >= index->member_count)
+        return NULL;
+
+    return index->members[member].name;
+}
+
+/**
+ * Extract one member of the archive, inflating from the nearest checkpoint in front
+ * of it.
+ *
+ * @param archive   The archive the index was built from, opened for reading.
+ * @param name      The member name as returned by minotar_gzindex_get_member_name().
+ * @param instance  A Minotar instance.  It is reset first, so one instance can extract
+ *                  any number of members.
+ * @return an error code as defined in the error struct.
+ */
+minotar_error_t minotar_gzindex_extract(const minotar_gzindex_t* index, FILE* archive, const char* name,
+                                        minotar_t* instance)
+{
+    // two zero blocks close the archive behind the member
+    static const char end_of_archive[2 * RECORD_BLOCK_ROUNDOFF] = {0};
+    const struct minotar_gzindex_member_* member = NULL;
+    const struct minotar_gzindex_point_* point = NULL;
+    minotar_error_t error = MINOTAR_noerror;
+    unsigned char* input = NULL;
+    unsigned char* output = NULL;
+    z_stream strm = {0};
+    uint64_t position = 0;
+    size_t low = 0;
+    size_t high = 0;
+    int ret = Z_OK;
+
+    if(index == NULL || archive == NULL || name == NULL || instance == NULL)
+        return MINOTAR_invalid_parameter;
+
+    for(size_t idx = 0; member == NULL && idx < index->member_count; ++idx) {
+        if(!strcmp(index->members[idx].name, name))
+            member = &index->members[idx];
+    }
+
+    if(member == NULL)
+        return MINOTAR_member_not_found;
+
+    // the last checkpoint at or in front of the member
+    high = index->point_count;
+    while(low < high) {
+        size_t mid = low + (high - low) / 2;
+        if(index->points[mid].out <= member->offset)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    if(low == 0)
+        return MINOTAR_header_invalid;
+
+    point = &index->points[low - 1];
+    position = point->out;
+
+    // a reused instance may sit past an end of archive and would skip the member
+    error = minotar_reset(instance);
+    if(error != MINOTAR_noerror)
+        return error;
+
+    input = malloc(MINOTAR_GZINDEX_CHUNK);
+    output = malloc(MINOTAR_GZINDEX_CHUNK);
+    if(input == NULL || output == NULL) {
+        error = MINOTAR_out_of_memory;
+        goto exit;
+    }
+
+    // the checkpoint is raw deflate data, there is no gzip header to skip
+    if(inflateInit2(&strm, -15) != Z_OK) {
+        error = MINOTAR_out_of_memory;
+        goto exit;
+    }
+
+    if(fseeko(archive, (off_t) (point->in - (point->bits ? 1 : 0)), SEEK_SET) != 0) {
+        error = MINOTAR_unknown_error;
+        goto inflate_exit;
+    }
+
+    if(point->bits) {
+        int byte = getc(archive);
+        if(byte == EOF) {
+            error = MINOTAR_truncated_archive;
+            goto inflate_exit;
+        }
+        inflatePrime(&strm, point->bits, byte >> (8 - point->bits));
+    }
+
+    inflateSetDictionary(&strm, point->window, MINOTAR_GZINDEX_WINDOW);
+
+    while(error == MINOTAR_noerror && position < member->end && ret != Z_STREAM_END) {
+        if(strm.avail_in == 0) {
+            strm.avail_in = fread(input, 1, MINOTAR_GZINDEX_CHUNK, archive);
+            if(strm.avail_in == 0) {
+                error = ferror(archive) ? MINOTAR_unknown_error : MINOTAR_truncated_archive;
+                break;
+            }
+            strm.next_in = input;
+        }
+
+        strm.avail_out = MINOTAR_GZINDEX_CHUNK;
+        strm.next_out = output;
+        ret = inflate(&strm, Z_NO_FLUSH);
+        if(ret == Z_NEED_DICT || ret == Z_DATA_ERROR || ret == Z_MEM_ERROR) {
+            error = (ret == Z_MEM_ERROR) ? MINOTAR_out_of_memory : MINOTAR_decompress_failed;
+            break;
+        }
+
+        // hand over whatever part of this output belongs to the member
+        uint64_t produced = MINOTAR_GZINDEX_CHUNK - strm.avail_out;
+        uint64_t start = (member->offset > position) ? member->offset - position : 0;
+        uint64_t end = MINOTAR_MIN(produced, member->end - position);
+        if(start < end)
+            error = minotar_decode(instance, (const char*) &output[start], (size_t) (end - start));
+
+        position += produced;
+    }
+
+    if(error == MINOTAR_noerror && position < member->end)
+        error = MINOTAR_truncated_archive;
+
+    if(error == MINOTAR_noerror)
+        error = minotar_decode(instance, end_of_archive, sizeof(end_of_archive));
+
+inflate_exit:
+    inflateEnd(&strm);
+
+exit:
+    free(input);
+    free(output);
+    return error;
+}
+
+
+// ------------------ PRIVATE FUNCTIONS ------------------------
+
+/**
+ * Save a checkpoint.  The window is circular, so the 32 KiB in front of the
+ * checkpoint are the left bytes at its end followed by everything before them.
+ *
+ * @param left  The bytes of the window not yet written by inflate.
+ * @return This function returns false when the index could not grow.
+ */
+static bool minotar_gzindex_add_point(minotar_gzindex_t* index, int bits, uint64_t in, uint64_t out,
+                                      unsigned left, const unsigned char* window)
+{
+    struct minotar_gzindex_point_* point = NULL;
+
+    if(index->point_count == index->point_capacity) {
+        size_t capacity = index->point_capacity ? index->point_capacity * 2 : 8;
+        struct minotar_gzindex_point_* points = realloc(index->points, capacity * sizeof(*points));
+        if(points == NULL)
+            return false;
+        index->points = points;
+        index->point_capacity = capacity;
+    }
+
+    point = &index->points[index->point_count++];
+    point->out = out;
+    point->in = in;
+    point->bits = bits;
+
+    if(left)
+        memcpy(point->window, window + MINOTAR_GZINDEX_WINDOW - left, left);
+    if(left < MINOTAR_GZINDEX_WINDOW)
+        memcpy(point->window + left, window, MINOTAR_GZINDEX_WINDOW - left);
+
+    return true;
+}
+
+/**
+ * Record the member the walker just finished.
+ *
+ * @return This function returns false when the index could not grow.
+ */
+static bool minotar_gzindex_add_member(minotar_gzindex_t* index, const struct minotar_gzindex_walker_* walker)
+{
+    struct minotar_gzindex_member_* member = NULL;
+
+    if(index->member_count == index->member_capacity) {
+        size_t capacity = index->member_capacity ? index->member_capacity * 2 : 64;
+        struct minotar_gzindex_member_* members = realloc(index->members, capacity * sizeof(*members));
+        if(members == NULL)
+            return false;
+        index->members = members;
+        index->member_capacity = capacity;
+    }
+
+    member = &index->members[index->member_count];
+    member->offset = walker->member_offset;
+    member->end = walker->next_header;
+    member->name = strdup(walker->long_name != NULL ? walker->long_name : walker->name);
+    if(member->name == NULL)
+        return false;
+
+    index->member_count++;
+    return true;
+}
+
+/**
+ * A header block is complete, work out where the next one is.
+ *
+ * @param offset    The uncompressed offset of the header.
+ * @return This function returns false when the index could not grow.
+ */
+static bool minotar_gzindex_walk_header(minotar_gzindex_t* index, struct minotar_gzindex_walker_* walker, uint64_t offset)
+{
+    const struct header_posix_ustar* header = (const struct header_posix_ustar*) walker->block;
+    const struct header_gnu_sparse* gnu = (const struct header_gnu_sparse*) walker->block;
+    uint64_t size = 0;
+    int length = 0;
+    bool result = true;
+
+    // old GNU sparse extension blocks sit between the header and the data
+    if(walker->sparse_extension) {
+        if(((const struct header_gnu_sparse_extension*) walker->block)->isextended)
+            return true;
+        walker->sparse_extension = false;
+        walker->next_header += walker->sparse_size + MINOTAR_CALC_PADDING(walker->sparse_size, RECORD_BLOCK_ROUNDOFF);
+        goto member_done;
+    }
+
+    // end of archive
+    if(minotar_is_zero(walker->block, sizeof(walker->block))) {
+        walker->done = true;
+        return true;
+    }
+
+    if(!walker->in_member) {
+        walker->member_offset = offset;
+        walker->in_member = true;
+    }
+
+    size = minotar_parse_numeric(header->size, sizeof(header->size));
+
+    switch(header->typeflag) {
+        // extended headers belong to the member that follows them.  PAX records are
+        // read as they can replace the name in the member's own header.
+        case FILE_TYPE_pax_extended:
+            free(walker->extended);
+            walker->extended = malloc((size_t) MINOTAR_MIN(size, MINOTAR_GZINDEX_EXTENDED_MAX));
+            if(walker->extended == NULL && size > 0)
+                return false;
+            walker->extended_length = 0;
+            walker->extended_remaining = size;
+            walker->next_header += size + MINOTAR_CALC_PADDING(size, RECORD_BLOCK_ROUNDOFF);
+            return true;
+        // GNU long names are not used by the extraction either
+        case FILE_TYPE_pax_global:
+        case 'L':
+        case 'K':
+            walker->next_header += size + MINOTAR_CALC_PADDING(size, RECORD_BLOCK_ROUNDOFF);
+            return true;
+        default:
+            break;
+    }
+
+    // otherwise the member name is the ustar prefix and name
+    if(!memcmp(header->magic, "ustar\0", 6) && header->prefix[0] != '\0')
+        length = snprintf(walker->name, sizeof(walker->name), "%.*s/", (int) sizeof(header->prefix), header->prefix);
+    snprintf(&walker->name[length], sizeof(walker->name) - length, "%.*s", (int) sizeof(header->name), header->name);
+
+    if(header->typeflag == FILE_TYPE_gnu_sparse && gnu->isextended) {
+        walker->sparse_size = size;
+        walker->sparse_extension = true;
+        return true;
+    }
+
+    walker->next_header += size + MINOTAR_CALC_PADDING(size, RECORD_BLOCK_ROUNDOFF);
+
+member_done:
+    walker->in_member = false;
+    result = minotar_gzindex_add_member(index, walker);
+    free(walker->long_name);
+    walker->long_name = NULL;
+    return result;
+}
+
+/**
+ * A PAX header is complete, take the member name from it.  The records are
+ * "<length> <key>=<value>\n" and GNU.sparse.name wins over path, as it names the
+ * expanded file.
+ *
+ * @return This function returns false when the name could not be copied.
+ */
+static bool minotar_gzindex_walk_extended(struct minotar_gzindex_walker_* walker)
+{
+    const char* records = walker->extended;
+    const char* end = records + walker->extended_length;
+    const char* name = NULL;
+    size_t name_length = 0;
+    bool sparse_name = false;
+
+    while(records < end) {
+        const char* key = records;
+        size_t record_length = 0;
+
+        while(key < end && *key >= '0' && *key <= '9' && record_length <= walker->extended_length)
+            record_length = record_length * 10 + (size_t) (*key++ - '0');
+
+        // a record cut off by the size limit ends the search
+        if(key == end || *key++ != ' ' || record_length > (size_t) (end - records) ||
+           records + record_length <= key)
+            break;
+
+        // the value runs up to the '\n' closing the record
+        const char* value_end = records + record_length - 1;
+        const char* equals = memchr(key, '=', (size_t) (value_end - key));
+        if(equals != NULL && equals - key == 15 && !memcmp(key, "GNU.sparse.name", 15)) {
+            name = equals + 1;
+            name_length = (size_t) (value_end - name);
+            sparse_name = true;
+        }
+        else if(equals != NULL && equals - key == 4 && !memcmp(key, "path", 4) && !sparse_name) {
+            name = equals + 1;
+            name_length = (size_t) (value_end - name);
+        }
+
+        records += record_length;
+    }
+
+    if(name != NULL && name_length > 0) {
+        free(walker->long_name);
+        walker->long_name = strndup(name, name_length);
+        if(walker->long_name == NULL)
+            return false;
+    }
+
+    free(walker->extended);
+    walker->extended = NULL;
+    return true;
+}
+
+/**
+ * Feed uncompressed output to the tar walker.
+ *
+ * @param position  The uncompressed offset of the first byte.
+ * @return This function returns false when the index could not grow.
+ */
+static bool minotar_gzindex_walk(minotar_gzindex_t* index, struct minotar_gzindex_walker_* walker,
+                                 const unsigned char* bytes, size_t length, uint64_t position)
+{
+    while(length > 0 && !walker->done) {
+        // the records of an extended header follow it directly
+        if(walker->extended_remaining > 0) {
+            size_t read_size = (size_t) MINOTAR_MIN(walker->extended_remaining, length);
+            size_t keep_size = MINOTAR_MIN(read_size, MINOTAR_GZINDEX_EXTENDED_MAX - walker->extended_length);
+            memcpy(&walker->extended[walker->extended_length], bytes, keep_size);
+            walker->extended_length += keep_size;
+            walker->extended_remaining -= read_size;
+            bytes += read_size;
+            length -= read_size;
+            position += read_size;
+
+            if(walker->extended_remaining == 0 && !minotar_gzindex_walk_extended(walker))
+                return false;
+            continue;
+        }
+
+        // skip file data up to the next header
+        if(walker->next_header >= position + length)
+            return true;
+
+        if(walker->next_header > position) {
+            size_t skip_size = (size_t) (walker->next_header - position);
+            bytes += skip_size;
+            length -= skip_size;
+            position += skip_size;
+        }
+
+        size_t copy_size = MINOTAR_MIN(RECORD_BLOCK_ROUNDOFF - walker->fill, length);
+        memcpy(&walker->block[walker->fill], bytes, copy_size);
+        walker->fill += copy_size;
+        bytes += copy_size;
+        length -= copy_size;
+        position += copy_size;
+
+        if(walker->fill < RECORD_BLOCK_ROUNDOFF)
+            return true;
+
+        uint64_t offset = position - RECORD_BLOCK_ROUNDOFF;
+        walker->fill = 0;
+        walker->next_header = position;
+        if(!minotar_gzindex_walk_header(index, walker, offset))
+            return false;
+    }
+
+    return true;
+}
@@ -15,33 +15,254 @@
 
 #include "minotar.h"
 #include "minotar_tarball_data.h"
-#include <stdio.h>
 #include <stdbool.h>
 #include <inttypes.h>
 #include <stddef.h>
+#include <string.h>
+
+/**
+ * Parser states.  Every state consumes a whole number of bytes of the record it
+ * belongs to and hands over to the next one when that part of the record is done.
+ */
+typedef enum minotar_state_ {
+    MINOTAR_STATE_header = 0,       // collecting a 512 byte record block header
+#if MINOTAR_HAVE_EXTENSIONS
+    MINOTAR_STATE_sparse_header,    // collecting an old GNU sparse extension block
+    MINOTAR_STATE_pax_header,       // parsing the records of a PAX extended header
+    MINOTAR_STATE_sparse_map,       // parsing the PAX 1.0 sparse map ahead of the file data
+#endif
+    MINOTAR_STATE_payload,          // writing file data
+    MINOTAR_STATE_skip,             // skipping the data of a record that is not a file
+    MINOTAR_STATE_padding,          // skipping the record padding up to the next block
+    MINOTAR_STATE_trailer           // past the end of archive marker
+} minotar_state_t;
+
+#if MINOTAR_HAVE_EXTENSIONS
+/**
+ * PAX keywords Minotar acts upon.  Everything else is parsed and dropped.
+ */
+typedef enum minotar_pax_key_ {
+    MINOTAR_PAX_KEY_unknown = 0,
+    MINOTAR_PAX_KEY_path,
+    MINOTAR_PAX_KEY_sparse_name,
+    MINOTAR_PAX_KEY_sparse_size,
+    MINOTAR_PAX_KEY_sparse_realsize,
+    MINOTAR_PAX_KEY_sparse_major,
+    MINOTAR_PAX_KEY_sparse_minor,
+    MINOTAR_PAX_KEY_sparse_numblocks,
+    MINOTAR_PAX_KEY_sparse_offset,
+    MINOTAR_PAX_KEY_sparse_numbytes,
+    MINOTAR_PAX_KEY_sparse_map
+} minotar_pax_key_t;
+
+/**
+ * Streaming state of a PAX extended header.  Records are "<length> <key>=<value>\n"
+ * and are parsed byte by byte so arbitrarily large headers never need to be buffered.
+ */
+struct minotar_pax_ {
+    uint64_t            record_remaining;   // bytes left in the current record
+    uint64_t            number;             // numeric value being accumulated
+    minotar_pax_key_t   key_id;
+    uint8_t             field;              // 0: length, 1: key, 2: value
+    size_t              key_length;
+    char                key[24];
+    char*               path;               // path override for the next entry
+    size_t              path_length;
+    size_t              path_capacity;
+    bool                path_from_sparse;   // GNU.sparse.name beats path
+};
+
+/**
+ * Sparse map of the current entry.  Data segments are written at their offsets and
+ * the gaps between them are left as holes.
+ */
+struct minotar_sparse_segment_ {
+    uint64_t offset;
+    uint64_t numbytes;
+};
+
+struct minotar_sparse_ {
+    struct minotar_sparse_segment_* map;
+    size_t      count;
+    size_t      capacity;
+    size_t      index;              // segment currently being written
+    uint64_t    segment_written;    // bytes already written to that segment
+    uint64_t    realsize;           // size of the expanded file
+    uint64_t    map_bytes;          // bytes of the PAX 1.0 map consumed so far
+    uint64_t    map_entries;        // numbers of the PAX 1.0 map still to come
+    uint64_t    number;
+    bool        have_number;
+    bool        map_counted;        // the PAX 1.0 map entry count has been read
+    bool        map_done;           // the PAX 1.0 map has been read completely
+    bool        half;               // the next value pushed is a numbytes
+    bool        active;
+    bool        pax_1_0;
+};
+#endif // MINOTAR_HAVE_EXTENSIONS
 
 /**
  * Internal structure definition for Minotar instance structure
  */
 struct minotar_ {
     const char*     extract_path;
-    FILE*           file;
+    int             root_fd;            // the extract directory, opened on first use
+    int             parent_fd;          // the directory of the last entry
+#if MINOTAR_HAVE_HEAP
+    char*           parent_path;        // its path relative to root_fd, ending in '/'
+    size_t          parent_length;
+    size_t          parent_capacity;
+#endif
+    bool            openat2_missing;
+    int             fd;
     uint64_t        bytes_remaining;
+    uint64_t        padding_remaining;
+    uint64_t        file_offset;
+    uint64_t        file_size;
     size_t          rx_byte_offset;
+    minotar_state_t state;
     minotar_error_t error;
-    bool            record_header_complete;
+#if MINOTAR_HAVE_EXTENSIONS
+    bool            sparse_detection;
+#endif
+    bool            punched_hole;
+    bool            blocked;            // the sink pushed back during this decode
+    bool            finish_pending;     // the sink has not closed the last file yet
+    bool            concatenated;
+    uint8_t         zero_blocks;        // consecutive zero blocks seen in place of a header
+    size_t          archive_count;
+    minotar_archive_callback_t archive_callback;
+    void*           archive_context;
+    bool            validate_only;
+    uint64_t        input_length;       // length of the whole stream, 0 if unknown
+    uint64_t        stream_offset;      // bytes of the stream decoded so far
+    minotar_payload_callback_t payload_callback;
+    void*           payload_context;
+#if MINOTAR_HAVE_PROGRESS
+    minotar_progress_callback_t progress_callback;
+    void*           progress_context;
+    uint64_t        progress_interval_ns;
+    uint64_t        progress_last_ns;   // time of the last progress report
+    size_t          progress_archives;  // archives whose end has been reported
+    uint64_t        sample_offset;      // stream offset after the last timed decode
+    uint64_t        sample_bytes;       // bytes of timed decodes not yet in the average
+    uint64_t        sample_ns;          // time spent inside those decodes
+    uint64_t        throughput;         // moving average of decode bytes per second
+    size_t          entries_completed;
+#endif
+    minotar_sink_t  sink;
+#if MINOTAR_WRITE_BUFFER_SIZE > 0
+    char*           write_buffer;       // file data waiting to go out in one large write
+    size_t          write_buffered;
+    uint64_t        write_buffer_offset;    // file offset of the first buffered byte
+#endif
     char            record_header_buf[512];
-    struct header_posix_ustar* tarball_record_block;
+    const struct header_posix_ustar* tarball_record_block;  // record_header_buf, or the input while a header is parsed in place
+#if MINOTAR_HAVE_EXTENSIONS
+    struct minotar_pax_ pax;
+    struct minotar_sparse_ sparse;
+#endif
 };
 
 // Tar headers and data are always rounded off to the nearest 512 bytes padded with whitespace
 #define RECORD_BLOCK_ROUNDOFF  (512)
 
-// min macro
+#if !MINOTAR_HAVE_HEAP && MINOTAR_WRITE_BUFFER_SIZE > 0
+#error "the write buffer needs a heap"
+#endif
+
+#if MINOTAR_HAVE_EXTENSIONS
+// longest PAX path accepted, null byte included
+#ifndef MINOTAR_PAX_PATH_MAX
+#define MINOTAR_PAX_PATH_MAX (4096)
+#endif
+
+// most data segments accepted in one sparse map, 16 bytes each
+#ifndef MINOTAR_SPARSE_MAX_SEGMENTS
+#define MINOTAR_SPARSE_MAX_SEGMENTS (64 * 1024)
+#endif
+#endif
+
+// longest entry path that can be extracted without a heap, null byte included.  paths
+// are resolved relative to the extract directory, so its length does not count.
+#ifndef MINOTAR_PATH_MAX
+#define MINOTAR_PATH_MAX (512)
+#endif
+
+#if MINOTAR_HAVE_PROGRESS
+// input between two timed decodes, for progress and throughput
+#define MINOTAR_SAMPLE_BYTES (64 * 1024)
+#endif
+
+// time the recommended chunk size should take to decode, and its bounds
+#define MINOTAR_CHUNK_TARGET_US (1000)
+#define MINOTAR_CHUNK_MIN (4 * 1024)
+#define MINOTAR_CHUNK_MAX (4 * 1024 * 1024)
+#define MINOTAR_CHUNK_DEFAULT (64 * 1024)
+
+// min and max macros
 #define MINOTAR_MIN(X, Y) (((X) < (Y)) ? (X) : (Y))
+#define MINOTAR_MAX(X, Y) (((X) > (Y)) ? (X) : (Y))
 
 // this function calculates how many bytes to pad the data to the nearest <block size> bytes
-#define MINOTAR_CALC_PADDING(idx, block_size) ((block_size - (offset ^ block_size)) & (block_size - 1))
+#define MINOTAR_CALC_PADDING(idx, block_size) (((block_size) - ((idx) & ((block_size) - 1))) & ((block_size) - 1))
+
+
+/**
+ * Numeric header fields are ascii octal, optionally padded with leading spaces and
+ * terminated with ' ' or '\0'.  GNU tar stores values too large for the field in
+ * base-256 instead, flagged by the high bit of the first byte.
+ *
+ * @return This function returns the value of the numeric field.
+ */
+static inline uint64_t minotar_parse_numeric(const char* field, size_t length)
+{
+    uint64_t value = 0;
+    size_t idx = 0;
+
+    if(length > 0 && (field[0] & 0x80)) {
+        value = field[0] & 0x3F;
+        for(idx = 1; idx < length; ++idx)
+            value = (value << 8) | (uint8_t) field[idx];
+        return value;
+    }
+
+    while(idx < length && field[idx] == ' ')
+        ++idx;
+
+    for(; idx < length && field[idx] >= '0' && field[idx] <= '7'; ++idx)
+        value = (value << 3) | (uint64_t) (field[idx] - '0');
+
+    return value;
+}
+
+/**
+ * Check a run of bytes for zeros.  The buffer is folded together 64 bytes at a time
+ * so the compiler can vectorize the inner loop, bailing out at the first stride that
+ * holds any data.
+ *
+ * @return This function returns true when every byte is zero.
+ */
+static inline bool minotar_is_zero(const char* bytes, size_t length)
+{
+    size_t idx = 0;
+
+    for(; idx + 64 <= length; idx += 64) {
+        uint64_t words[8];
+        uint64_t acc = 0;
+        memcpy(words, &bytes[idx], sizeof(words));
+        for(size_t word = 0; word < 8; ++word)
+            acc |= words[word];
+        if(acc != 0)
+            return false;
+    }
+
+    for(; idx < length; ++idx) {
+        if(bytes[idx] != 0)
+            return false;
+    }
+
+    return true;
+}
 
 
 #endif // MINOTAR_INTERNAL_H
@@ -22,7 +22,10 @@ typedef enum tar_file_type_ {
     FILE_TYPE_block_special='4',
     FILE_TYPE_directory='5',
     FILE_TYPE_fifo='6',
-    FILE_TYPE_continuous_file='7'
+    FILE_TYPE_continuous_file='7',
+    FILE_TYPE_pax_global='g',
+    FILE_TYPE_pax_extended='x',
+    FILE_TYPE_gnu_sparse='S'
 } tar_file_type_t;
 
 struct header_posix_ustar {
@@ -33,7 +36,7 @@ struct header_posix_ustar {
     char	       size[12];
     char	       mtime[12];
     char	       checksum[8];
-    tar_file_type_t	typeflag;
+    char	       typeflag;
     char	       linkname[100];
     char	       magic[6];
     char	       version[2];
@@ -45,4 +48,31 @@ struct header_posix_ustar {
     char	       pad[12];
 };
 
+// one entry of a GNU sparse map: a run of data stored at offset in the real file
+struct header_gnu_sparse_entry {
+    char	       offset[12];
+    char	       numbytes[12];
+};
+
+// old GNU header as written for 'S' sparse files; overlays header_posix_ustar
+struct header_gnu_sparse {
+    char	       header[345];
+    char	       atime[12];
+    char	       ctime[12];
+    char	       offset[12];
+    char	       longnames[4];
+    char	       unused[1];
+    struct header_gnu_sparse_entry sparse[4];
+    char	       isextended;
+    char	       realsize[12];
+    char	       pad[17];
+};
+
+// extension block following an old GNU sparse header when isextended is set
+struct header_gnu_sparse_extension {
+    struct header_gnu_sparse_entry sparse[21];
+    char	       isextended;
+    char	       pad[7];
+};
+
 #endif // MINOTAR_TAR_DEFINITIONS_H